@@ -0,0 +1,267 @@
+/*This file is part of the MPI Sessions library.
+ *
+ *This file, kvs_bench.c measures the throughput of KVS_Get while the number 
+ *of concurrently reading ranks grows. Rank 0 acts as a (rare) writer if 
+ *-writer is given, all other ranks are readers.
+ *With -notify it instead measures how long it takes until all other ranks, 
+ *watching the set, notice that rank 0 changed it. -destroy does the same for a set 
+ *that rank 0 destroys, and checks that the watchers are told it is gone.
+ *
+ *Usage: mpirun -np <n> bench/kvs_bench -ps bench/psets.txt [-writer] [-time <sec>] [-notify] [-destroy]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <mpi.h>
+#include <mpisessions.h>
+#include <kvs.h>
+
+#define BENCH_SET "mpi://WORLD"
+#define BENCH_DESTROY_SET "bench://destroyed" //Created and destroyed again by -destroy
+
+//Call KVS_Get in a loop for the given time, returns the number of calls
+long bench_reader(double duration){
+	int num_ranks, version, *ranks, setnumber;
+	long count = 0;
+	double end = MPI_Wtime() + duration;
+	
+	do{
+		for(int i = 0; i < 256; i++){
+			KVS_Get(BENCH_SET, &num_ranks, &ranks, &version, &setnumber);
+			free(ranks);
+		}
+		count += 256;
+	}while(MPI_Wtime() < end);
+	
+	return count;
+}
+
+//Rewrite the set every millisecond for the given time, returns the number of writes
+long bench_writer(double duration){
+	int num_ranks, version, *ranks, setnumber;
+	long count = 0;
+	double end = MPI_Wtime() + duration;
+	
+	KVS_Get(BENCH_SET, &num_ranks, &ranks, &version, &setnumber);
+	while(MPI_Wtime() < end){
+		KVS_Put(BENCH_SET, num_ranks, ranks);
+		count++;
+		usleep(1000);
+	}
+	free(ranks);
+	
+	return count;
+}
+
+//Look up every set once per round, returns the time per lookup
+double bench_lookup(int rounds){
+	int num_ranks, version, *ranks, setnumber;
+	int n = KVS_Get_global_nsets();
+	char **names = KVS_Get_global_processsets(&n);
+	
+	double start = MPI_Wtime();
+	for(int r = 0; r < rounds; r++){
+		for(int i = 0; i < n; i++){
+			KVS_Get(names[i], &num_ranks, &ranks, &version, &setnumber);
+			free(ranks);
+		}
+	}
+	double time = (MPI_Wtime() - start) / ((double) rounds * n);
+	
+	for(int i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+	return time;
+}
+
+//MPI_Wtime is not necessarily synchronized between processes, this clock is on a node
+double monotonic_time(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//Rank 0 rewrites the set while all other ranks watch it. Returns the average time 
+//from the start of the Put until the last watcher noticed, put_time is the 
+//average duration of the Put
+double bench_notify(int rounds, double *put_time){
+	int num_ranks, version, *ranks, setnumber, rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Session *session;
+	MPI_Session_init(&session);
+	MPI_Info info;
+	double latency = 0;
+	*put_time = 0;
+	
+	KVS_Get(BENCH_SET, &num_ranks, &ranks, &version, &setnumber);
+	for(int r = 0; r < rounds; r++){
+		if(rank > 0){
+			MPI_Session_get_set_info(&session, BENCH_SET, &info);
+			MPI_Session_iwatch_pset(&info);
+		}
+		MPI_Barrier(MPI_COMM_WORLD);
+		
+		double start = monotonic_time(), noticed = 0, last;
+		if(rank == 0){
+			KVS_Put(BENCH_SET, num_ranks, ranks);
+			*put_time += monotonic_time() - start;
+		}
+		else{
+			//Yield, the node may be oversubscribed
+			while(!MPI_Session_check_psetupdate(info))
+				sched_yield();
+			noticed = monotonic_time();
+			MPI_Info_free(&info);
+		}
+		
+		MPI_Reduce(&noticed, &last, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+		latency += last - start;
+	}
+	free(ranks);
+	free(session);
+	
+	*put_time /= rounds;
+	return latency / rounds;
+}
+
+//Rank 0 creates a set of all ranks, which all other ranks watch and hold a handle to, 
+//and destroys it again. Returns the average time from the start of the destroy until 
+//the last watcher noticed, aborts if a watcher still finds the set afterwards
+double bench_destroy(int rounds){
+	int size, rank;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Session *session;
+	MPI_Session_init(&session);
+	MPI_Session_set_prebuild(true); //Only with MPI_THREAD_MULTIPLE, a watch that fires starts a creation then
+	double latency = 0;
+	
+	int *ranks = malloc(sizeof(int) * size);
+	for(int i = 0; i < size; i++)
+		ranks[i] = i;
+	
+	for(int r = 0; r < rounds; r++){
+		if(rank == 0 && MPI_Session_create_pset(BENCH_DESTROY_SET, size, ranks) != MPI_SUCCESS){
+			printf("destroy: cannot create %s\n", BENCH_DESTROY_SET);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		MPI_Session_sync_psets(&session);
+		
+		MPI_Pset_handle handle;
+		if(rank > 0){
+			MPI_Session_get_pset_handle(&session, BENCH_DESTROY_SET, &handle);
+			MPI_Session_iwatch_pset_handle(&handle);
+		}
+		MPI_Barrier(MPI_COMM_WORLD);
+		
+		double start = monotonic_time(), noticed = 0, last;
+		if(rank == 0)
+			MPI_Session_destroy_pset(BENCH_DESTROY_SET);
+		else{
+			while(!MPI_Session_check_psetupdate_handle(&handle))
+				sched_yield();
+			noticed = monotonic_time();
+			
+			MPI_Group group;
+			MPI_Pset_handle current;
+			MPI_Group_create_from_pset_handle(&session, &handle, &group);
+			if(group != MPI_GROUP_NULL || MPI_Session_get_pset_handle(&session, BENCH_DESTROY_SET, &current) == MPI_SUCCESS || 
+					MPI_Session_fetch_latestversion(BENCH_DESTROY_SET) != -1 || MPI_Session_check_in_processet(BENCH_DESTROY_SET)){
+				printf("destroy: rank %i still finds %s\n", rank, BENCH_DESTROY_SET);
+				MPI_Abort(MPI_COMM_WORLD, 1);
+			}
+		}
+		
+		MPI_Reduce(&noticed, &last, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+		latency += last - start;
+		MPI_Session_sync_psets(&session);
+	}
+	free(ranks);
+	free(session);
+	return latency / rounds;
+}
+
+int main(int argc, char **argv){
+	bool writer = false, notify = false, destroy = false;
+	double duration = 1.0;
+	for(int i = 0; i < argc; i++){
+		if(strcmp(argv[i], "-writer") == 0)
+			writer = true;
+		if(strcmp(argv[i], "-notify") == 0)
+			notify = true;
+		if(strcmp(argv[i], "-destroy") == 0)
+			destroy = true;
+		if(strcmp(argv[i], "-time") == 0 && i+1 < argc)
+			duration = strtod(argv[i+1], NULL);
+	}
+	
+	MPI_Session_preparation(argc, argv);
+	
+	int size, rank;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	
+	if(notify){
+		struct KVS_stats stats;
+		double put_time;
+		KVS_Reset_stats();
+		double latency = bench_notify(200, &put_time);
+		KVS_Get_stats(&stats);
+		if(rank == 0)
+			printf("notify %i watchers: %.1f us until all noticed, %.1f us per Put, %.1f us lock held per Put\n", 
+				size-1, latency * 1e6, put_time * 1e6, stats.lock_holds ? stats.lock_time / stats.lock_holds * 1e6 : 0.0);
+		MPI_Session_free();
+		return 0;
+	}
+	
+	if(destroy){
+		double latency = bench_destroy(100);
+		if(rank == 0)
+			printf("destroy, %i watchers: %.1f us until all noticed\n", size-1, latency * 1e6);
+		MPI_Session_free();
+		return 0;
+	}
+	
+	if(rank == 0)
+		printf("%8s %16s %16s %10s\n", "readers", "gets/s total", "gets/s/reader", "writes");
+	
+	int readers = 1;
+	while(readers < size){
+		long gets = 0, writes = 0, total_gets, total_writes;
+		
+		MPI_Barrier(MPI_COMM_WORLD);
+		if(rank == 0 && writer)
+			writes = bench_writer(duration);
+		else if(rank > 0 && rank <= readers)
+			gets = bench_reader(duration);
+		MPI_Barrier(MPI_COMM_WORLD);
+		
+		MPI_Reduce(&gets, &total_gets, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+		MPI_Reduce(&writes, &total_writes, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+		
+		if(rank == 0)
+			printf("%8i %16.0f %16.0f %10li\n", readers, total_gets / duration, 
+				total_gets / duration / readers, total_writes);
+		
+		if(readers == size-1)
+			break;
+		readers = (readers*2 < size-1) ? readers*2 : size-1;
+	}
+	
+	if(rank == 0){
+		struct KVS_stats stats;
+		KVS_Reset_stats();
+		double time = bench_lookup(100);
+		KVS_Get_stats(&stats);
+		printf("lookup of %i sets: %.3f us per Get, %.2f probes per lookup\n", KVS_Get_global_nsets(), 
+			time * 1e6, stats.lookups ? (double) stats.probes / stats.lookups : 0.0);
+	}
+	
+	MPI_Session_free();
+	return 0;
+}
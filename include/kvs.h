@@ -14,18 +14,89 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <mpisessions.h>
 
+//Per-thread counters of the KVS
+struct KVS_stats{
+	long lookups; //Number of name lookups
+	long probes; //Number of key comparisons done by these lookups
+	long lock_holds; //Number of times a KVS lock was taken
+	double lock_time; //Seconds these locks were held
+	long notifications; //Messages posted to watchers, including forwarded ones
+	double notify_time; //Seconds spent sending notifications after updates
+};
+
+//A notification is KVS_VERSION_UPDATE followed by the ranks the receiver passes it on to
+#define KVS_NOTIFY_MAX_RANKS 64
+#define KVS_NOTIFY_MSG_LEN (1 + KVS_NOTIFY_MAX_RANKS)
+
+//Encodings of the ranks of a process set
+#define KVS_REP_LIST 0 //Explicit ranks, in the order they were put
+#define KVS_REP_RANGES 1 //Pairs of lower and upper bound, ascending
+#define KVS_REP_BITMAP 2 //First rank, followed by one bit per rank
+
+//Membership changes recorded in the delta log of a set
+#define KVS_DELTA_RESET 0 //The set was replaced as a whole by KVS_Put
+#define KVS_DELTA_ADD 1
+#define KVS_DELTA_DEL 2
+#define KVS_DELTA_DESTROY 3 //Only in events, the set was deleted
+
+struct KVS_delta{
+	int version; //Version of the set after the change
+	int op; //One of KVS_DELTA_*
+	int rank;
+};
+
+//Change of a watched set, delivered through the mailbox of the watcher
+struct KVS_event{
+	int setnumber; //-1 if events were lost, the watched sets have to be read again
+	int version; //Version of the set after the change
+	int op; //One of KVS_DELTA_*
+	int rank; //Added or deleted rank, -1 for the other ops
+};
+
+//Read-only view of a process set in the shared memory, see KVS_Get_view
+struct KVS_view{
+	const int *data; //Encoded ranks, use KVS_view_expand/KVS_view_contains
+	int rep; //One of KVS_REP_*
+	int len; //Number of ints in data
+	int base_num_ranks; //Number of ranks in data
+	const struct KVS_delta *log; //Ring of deltas of the set
+	int log_first; //Position in the ring of the first delta not contained in data
+	int num_deltas; //Number of these deltas
+	int num_ranks; //Number of ranks with the deltas applied
+	int version;
+	int setnumber;
+	unsigned int seq; //Sequence counter of the entry when the view was taken
+	unsigned int generation; //Generation of the KVS tables when the view was taken
+};
 
 int KVS_Get_local_nsets();
 int KVS_Get_global_nsets();
 char** KVS_Get_local_processsets(int);
-char** KVS_Get_global_processsets(int);
+bool KVS_Check_member(char *);
+int KVS_Get_sets_of_rank(int, int **);
+char** KVS_Get_processsets_of_rank(int, int *);
+char** KVS_Get_global_processsets(int *);
+int KVS_Get_all_sets(MPI_Pset_summary **);
 //void KVS_Get_internal(char *, int*, int**, int*, int*, bool);
 //void KVS_Put_internal(char *, int, int*, bool);
-void KVS_Get(char *, int*, int**, int*, int*);
-void KVS_Put(char *, int, int*);
-void KVS_Add(char *, int);
-void KVS_Del(char *, int);
+bool KVS_Get(char *, int*, int**, int*, int*);
+bool KVS_Get_view(char *, struct KVS_view *);
+bool KVS_Get_view_version(char *, int, struct KVS_view *);
+bool KVS_Release_view(struct KVS_view *);
+int KVS_Get_version(char *);
+int KVS_view_expand(const struct KVS_view *, int *);
+bool KVS_view_contains(const struct KVS_view *, int);
+int KVS_Put(char *, int, int*);
+int KVS_Create(char *, int, int*);
+int KVS_Destroy(char *);
+int KVS_Add(char *, int);
+int KVS_Del(char *, int);
+int KVS_Get_diff(char *, int, int*, int*, int**, int*, int**);
+int KVS_Pin_version(char *, int);
+int KVS_Unpin_version(char *, int);
+void KVS_Use_window(MPI_Comm, size_t);
 void KVS_initialise();
 void KVS_open();
 void KVS_addto_world();
@@ -34,7 +105,25 @@ int KVS_Watch_keyupdate_blocking(char *);
 //int KVS_Fetch_latestversion(char *);
 //int KVS_Get_kvsversion();
 void KVS_ask_for_update(int);
+void KVS_Notification_received(int, const int *, MPI_Status *);
+int KVS_Get_watch_version(int);
+void KVS_Wait_version(int, int);
+int KVS_Get_change_count();
+bool KVS_Wait_change(int, double);
+bool KVS_Wait_replicas(int, double);
+void KVS_Wake_change();
+void KVS_Progress_notifications();
+void KVS_Progress_replicas();
+void KVS_Sync_replicas();
+void KVS_Setup_replicas(int, int, const int *);
+void KVS_Use_daemon(const char *, bool, bool);
+void KVS_Sync();
+void KVS_Open_mailbox();
+int KVS_Poll_events();
+bool KVS_Next_event(struct KVS_event *);
 void KVS_free();
+void KVS_Get_stats(struct KVS_stats *);
+void KVS_Reset_stats();
 //int count_words(char *);
 //int hash(const char*, int);
 
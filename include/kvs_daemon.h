@@ -0,0 +1,41 @@
+/*This file is part of the MPI Sessions library.
+ *
+ *This file, kvs_daemon.h describes the protocol between the library and
+ *the KVS daemon in kvs_daemon.c, which stands in for the KVS of a resource manager.
+*/
+
+#ifndef KVS_DAEMON_H
+#define KVS_DAEMON_H
+
+#define KVS_DAEMON_SOCKET "/tmp/mpisessions_kvsd" //Default path of the socket, MPI_SESSIONS_DAEMON overrides it
+#define KVS_DAEMON_KEY_LENGTH 50 //Same as KVS_MAX_SET_NAME_LENGTH
+#define KVS_DAEMON_MAX_RANKS (1 << 24) //Bound of num_ranks and of every rank, longer messages are malformed
+
+//Requests, the reply is a message with the same op
+#define KVS_DAEMON_RESET 0 //Forget all sets, sent once at startup
+#define KVS_DAEMON_CREATE 1
+#define KVS_DAEMON_DESTROY 2
+#define KVS_DAEMON_PUT 3
+#define KVS_DAEMON_ADD 4
+#define KVS_DAEMON_DEL 5
+#define KVS_DAEMON_SUBSCRIBE 6 //The connection gets the events from now on
+#define KVS_DAEMON_SYNC 7 //Only the sequence number in the reply
+#define KVS_DAEMON_LOOKUP 8 //The version of the set, status -1 if there is none
+
+//Pushed to subscribers after every change
+#define KVS_DAEMON_EVENT 9
+
+//A message is followed by num_ranks ints. Requests may be pipelined, replies
+//come in the order of the requests and carry their id, the library matches them by it.
+//The daemon drops a client that sends a malformed message, the library exits on one
+struct KVS_daemon_msg{
+	int op; //One of KVS_DAEMON_*
+	int id; //Requests: echoed in the reply. Events: sequence number of the event
+	int status; //Replies: 0 or -1. Events: the op of the request that changed the set
+	int version; //Replies and events: version of the set after the change
+	int rank; //ADD and DEL: the rank. Replies: sequence number of the last event once the request was handled
+	int num_ranks; //Events carry all ranks of the set, none after KVS_DAEMON_DESTROY
+	char key[KVS_DAEMON_KEY_LENGTH];
+};
+
+#endif
@@ -27,27 +27,81 @@ extern MPI_Comm mpi_world_comm;
 
 extern bool *requests_valid;
 typedef struct{
-  MPI_Group* group;
+  MPI_Group group; //Last group created in the session, owned by the group cache
 } MPI_Session;
 
+#define MPI_PSET_NAME_LEN 50
+
+//A process set at a certain version, filled by MPI_Session_get_pset_handle. 
+//Taken by the _pset_handle variants of the routines instead of an MPI_Info
+typedef struct{
+  int setnumber; //Index of the set in the KVS, -1 for mpi://SELF
+  int version;
+  int size;
+  char name[MPI_PSET_NAME_LEN];
+} MPI_Pset_handle;
+
+//Entry of MPI_Session_get_all_psets_info
+typedef struct{
+  MPI_Pset_handle handle;
+  bool member; //This process is part of the set
+} MPI_Pset_summary;
+
+//Handler for changes of a process set: set name, old version, new version, user argument
+typedef void (*MPI_Session_pset_callback)(char *, int, int, void *);
+
 void MPI_Session_preparation(int,char **);
 void MPI_Session_init(MPI_Session**);
 void MPI_Session_get_nsets(MPI_Session**, int *);
 void MPI_Session_get_global_nsets(MPI_Session**, int *);
 void MPI_Session_get_pset_names(MPI_Session**, char***, int);
 void MPI_Session_get_global_pset_names(MPI_Session**, char***, int);
+int MPI_Session_get_live_pset_names(MPI_Session**, char***, int *);
+int MPI_Session_get_psets_of_rank(int, int *, char ***);
+int MPI_Session_get_all_psets_info(MPI_Session**, int *, MPI_Pset_summary **);
+int MPI_Session_sync_psets(MPI_Session**);
 void MPI_Group_create_from_session(MPI_Session**, char*,MPI_Group*, MPI_Info);
+void MPI_Group_create_from_pset_handle(MPI_Session**, MPI_Pset_handle *, MPI_Group*);
 void MPI_Create_worldgroup_from_ps();
 void MPI_Comm_create_from_group(MPI_Group, char *, MPI_Comm*, MPI_Info);
+int MPI_Comm_icreate_from_group(MPI_Group, char *, MPI_Comm*, MPI_Info, MPI_Request *);
+void MPI_Comm_create_from_pset_handle(MPI_Group, MPI_Pset_handle *, MPI_Comm*);
+int MPI_Comm_icreate_from_pset_handle(MPI_Group, MPI_Pset_handle *, MPI_Comm*, MPI_Request *);
+//Groups and communicators of the routines above are shared through a cache, they must 
+//only be given back with these and never with MPI_Group_free/MPI_Comm_free
+int MPI_Session_release_group(MPI_Group *);
+int MPI_Session_release_comm(MPI_Comm *);
 void MPI_Session_compute_setparameters(int,char **);
+void MPI_Session_broadcast_setparameters(MPI_Comm);
 int MPI_Session_check_in_processet(char *);
 int MPI_Session_check_psetupdate(MPI_Info);
+int MPI_Session_check_psetupdate_handle(MPI_Pset_handle *);
+int MPI_Session_get_psetupdate(MPI_Info, int *, int *, int *);
+int MPI_Session_testsome_pset(int, MPI_Info *, int *, int *);
+int MPI_Session_waitany_pset(int, MPI_Info *, int *);
+int MPI_Session_waitany_pset_timeout(int, MPI_Info *, double, int *);
+int MPI_Session_testsome_pset_handle(int, MPI_Pset_handle *, int *, int *);
+int MPI_Session_waitany_pset_handle(int, MPI_Pset_handle *, int *);
+int MPI_Session_waitany_pset_handle_timeout(int, MPI_Pset_handle *, double, int *);
+int MPI_Session_register_pset_callback(char *, MPI_Session_pset_callback, void *);
+int MPI_Session_unregister_pset_callback(char *);
+int MPI_Session_start_progress_thread();
+int MPI_Session_stop_progress_thread();
 void MPI_Session_iwatch_pset(MPI_Info*);
+void MPI_Session_iwatch_pset_handle(MPI_Pset_handle *);
 int MPI_Session_watch_pset(char *);
+int MPI_Session_set_prebuild(bool);
+int MPI_Session_get_prebuilt_comm(char *, MPI_Group *, MPI_Comm *, int *);
 int MPI_Session_fetch_latestversion(char *);
+int MPI_Session_create_pset(char *, int, int *);
+int MPI_Session_destroy_pset(char *);
+int MPI_Session_get_pset_diff(char *, int, int *, int *, int **, int *, int **);
+int MPI_Session_pin_version(char *, int);
+int MPI_Session_unpin_version(char *, int);
 void MPI_Session_addto_pset(char *,int);
 void MPI_Session_deletefrom_pset(char *, int);
 void MPI_Session_get_set_info(MPI_Session**, char *, MPI_Info*);
+int MPI_Session_get_pset_handle(MPI_Session**, char *, MPI_Pset_handle *);
 void MPI_Session_uniquename();
 void MPI_Session_gather_processnames(int,int);
 void MPI_Session_finalize(MPI_Session**);
@@ -20,38 +20,371 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <kvs_daemon.h>
 
 #define KVS_MAX_SET_NAME_LENGTH 50
+#define KVS_LOCK_STRIPES 64 //Number of locks protecting the entries, a set is mapped to a stripe by its name
+#define KVS_MIN_BLOCK 16 //Initial size in ints of the ranks and updates blocks of a set
+#define KVS_ARENA_MIN_SIZE (1UL << 20) //Initial size of the shared memory arena in bytes
+#define KVS_ARENA_RESERVE (1UL << 34) //Address space every process reserves for the arena, it can grow up to this
+#define KVS_WINDOW_SIZE (1UL << 28) //Default size of the MPI window that holds the arena with KVS_Use_window, it cannot grow beyond
+#define KVS_ARENA_CLASSES 40 //Size classes of the allocator, blocks are powers of two
+#define KVS_ARENA_MIN_CLASS 5 //Smallest block has 32 bytes
+#define KVS_RETIRED_MAX 64 //Replaced tables waiting for their last reader, more are never freed
+#define KVS_READER_SLOTS 1024 //Threads that announce the tables they read, once there are more no table is freed
+#define KVS_PROBE_TABLE_SIZE 64 //Fallback table for sets that are not covered by the perfect hash, power of two
+#define KVS_PROBE_SEED 0x9e3779b9
+#define KVS_PROBE_EMPTY -1
+#define KVS_PROBE_DELETED -2
+#define KVS_LOG_SIZE 64 //Deltas kept per set, older ones are overwritten
+#define KVS_LOG_COMPACT 32 //Pending deltas are folded into the ranks block once there are that many, less than KVS_LOG_SIZE
+#define KVS_HISTORY 4 //Replaced ranks blocks kept per set, for views of older versions
+#define KVS_PINS 8 //Versions of a set that can be pinned at the same time
+#define KVS_MAILBOX_SIZE 256 //Events a mailbox holds until its owner drains it, power of two
+#define KVS_SNAPSHOT_PASSES 8 //Passes of KVS_Get_all_sets, the last one keeps the writers out
+#define KVS_NOTIFY_TREE 32 //Up to this many watchers are notified directly, more by a binomial tree
+#define KVS_REPLICA_TAG 1 //Tag of the updates sent to the other replicas on kvs_replica_comm
+#define KVS_REPLICA_POLL 0.001 //Seconds a waiting node leader sleeps before it looks for updates of other nodes again
+#define KVS_REPLICA_HEADER ((int)((sizeof(struct KVS_replica_msg) + sizeof(int) - 1) / sizeof(int))) //Ints before the ranks of a replica message
+#define KVS_TOMBSTONES 256 //Destroyed sets a replica remembers to drop late changes of them, older ones are overwritten
+#define KVS_DAEMON_CHUNK 65536 //Bytes the receiver of the daemon events reads at once
+#define KVS_DAEMON_PIPELINE 64 //Requests of this process that may wait for their reply at once, see daemon_post
 #define KVS_VERSION_UPDATE 31173 //Or anything else really, I should be the only one still using MPI_COMM_WORLD at that point, if not I probably need to make a copy anyway
 
+//Version word of a set for futex waits. It never moves, unlike the entries table, 
+//and is not freed with the set, so sleeping watchers always wake up on it
+struct KVS_watch{
+	int version; //Copy of the version of the set, written after every update
+	int num_waiters; //Processes sleeping on version, writers only wake if there are any
+};
+
+//Change of a set sent to the other replicas, followed by the ranks of the set after it
+struct KVS_replica_msg{
+	int op; //One of KVS_DELTA_*
+	int version; //Version of the set after the change on its origin
+	int origin; //Node that made the change
+	int rank; //Added or deleted rank, -1 for the other ops
+	int created_node, created_id; //Creation of the set the change belongs to, see KVS_entry
+	int num_ranks;
+	char key[KVS_MAX_SET_NAME_LENGTH];
+};
+
+//Creation of a set that was destroyed
+struct KVS_tombstone{
+	char key[KVS_MAX_SET_NAME_LENGTH];
+	int created_node, created_id;
+};
+
+//A block that lock-free readers may still use
+struct KVS_retired{
+	size_t offset;
+	size_t size;
+	unsigned int generation; //First generation without the block, it is free once all readers got there
+};
+
+//Everything lives in one shared memory arena, the head is at offset 0. 
+//All references into the arena are offsets, so every process can map it anywhere
 struct KVS_head{
-	int num_entries;
+	pid_t owner; //Process that created the arena, see arena_stale
+	size_t arena_size; //Current size of the arena, only grows
+	size_t arena_used; //Bump pointer of the allocator
+	size_t free_lists[KVS_ARENA_CLASSES]; //First free block per size class, 0 if empty
+	size_t entries_off;
+	size_t mph_off; //Displacements of the perfect hash
+	size_t probe_off; //Fallback probe table
+	struct KVS_retired retired[KVS_RETIRED_MAX]; //Tables replaced by growths, see reclaim_tables
+	int num_retired;
+	unsigned int readers[KVS_READER_SLOTS]; //Generation of the tables every reading thread uses, UINT_MAX once it left
+	int num_readers; //Slots handed out so far
+	unsigned int generation; //Changes whenever tables move, odd while they do
+	int num_entries; //Number of setnumbers handed out, they are never reused
+	int num_sets; //Number of sets that are not deleted
+	int table_size; //Capacity of the entries table
+	int version;
+	int mph_size; //Number of sets covered by the perfect hash, they have setnumber 0..mph_size-1
+	int mph_buckets; //Number of displacements of the perfect hash
+	int probe_size; //Size of the fallback probe table, power of two
+	int probe_used; //Used slots of the probe table, including deleted ones
+	size_t mailboxes_off; //Offset of the mailbox of every rank, 0 for ranks without one
+	int mailboxes_size; //Capacity of that directory
+	struct KVS_watch changes; //Counts the updates of all sets, for processes waiting for any of them
+	int daemon_seq; //Last event of the KVS daemon applied to this replica, see KVS_Use_daemon
+	int creations; //Sets created on this node so far
+	struct KVS_tombstone tombstones[KVS_TOMBSTONES]; //Ring of the last destroyed sets
+	int num_tombstones; //Ever recorded
+	size_t index_off; //Reverse index, a bitmap of index_words words over the setnumbers per rank
+	int index_ranks; //Number of ranks covered by the index, all ranks of all sets are below
+	int index_words;
+	unsigned int index_seq; //Odd while the index moves
+	sem_t sem; //Global lock, only for structural changes of the KVS
+	sem_t arena_sem; //Lock of the allocator
+	sem_t stripes[KVS_LOCK_STRIPES]; //Locks for updates of single entries
+};
+
+//An encoded ranks block that belongs to a certain version of a set
+struct KVS_snapshot{
 	int version;
-	sem_t sem;
+	int num_ranks;
+	int rep;
+	int rep_len;
+	int mem; //Capacity of the block in ints
+	int pins; //Only for pinned versions, number of pins held
+	size_t offset;
+};
+
+//Events for a watching process, written by any writer and read only by the owner. 
+//The sequence number of a slot is its position while it is free and position+1 once 
+//an event was written to it
+struct KVS_slot{
+	unsigned long seq;
+	struct KVS_event event;
+};
+
+struct KVS_mailbox{
+	unsigned long head; //Next position writers reserve
+	unsigned long tail; //Next position the owner reads, only the owner writes it
+	int lost; //Set if events were dropped because the mailbox was full
+	struct KVS_slot slots[KVS_MAILBOX_SIZE];
 };
 
 struct KVS_entry{
+	unsigned int seq; //Sequence counter, odd while a writer modifies the entry
+	int deleted; //Set by KVS_Destroy, the setnumber is not used again
 	int key_length;
 	char key[KVS_MAX_SET_NAME_LENGTH];
 	int version;
-	int mem_version;
-	int num_ranks;
+	int origin; //Node whose update produced the version, breaks ties between replicas
+	int created_node; //Node that created the set, -1 for the sets read at startup
+	int created_id; //Number of the creation on that node, tells the set from others of the same name
+	int num_ranks; //Number of ranks, with the pending deltas applied
+	int base_num_ranks; //Number of ranks in the ranks block
+	int base_version; //Version of the set the ranks block belongs to
+	int rep; //Encoding of the ranks block, one of KVS_REP_*
+	int rep_len; //Number of ints used by the encoding
+	int log_count; //Number of deltas ever appended to the log
+	int num_pending; //The last deltas of the log that are not in the ranks block yet
 	int num_updates;
-	int mem_ranks;
-	int mem_updates;
+	int mem_ranks; //Capacity of the ranks block in ints
+	int mem_updates; //Capacity of the updates block in ints
+	size_t ranks_off; //Offset of the ranks block in the arena
+	size_t updates_off; //Offset of the updates block in the arena
+	size_t log_off; //Offset of the delta log, a ring of KVS_LOG_SIZE deltas
+	size_t watch_off; //Offset of the version word for watchers
+	int num_history;
+	struct KVS_snapshot history[KVS_HISTORY]; //Replaced ranks blocks, newest first
+	struct KVS_snapshot pinned[KVS_PINS]; //Copies of pinned versions, free if pins is 0
 };
 
-int *mem_version;
-int *mem_ranks;
-int *mem_updates;
-
-const char const *head_identifier = "_kvs_head";
-const char const *entries_identifier = "_kvs_entries";
+const char const *arena_identifier = "_kvs";
 
+char *arena_baseptr;
 struct KVS_head *head_baseptr;
-struct KVS_entry *entries_baseptr;
-int **ranks_baseptr;
-int **updates_baseptr;
+
+//Every thread follows the tables on its own, a progress thread may refresh them 
+//while the main thread uses them
+__thread struct KVS_entry *entries_baseptr;
+__thread int *mph_baseptr; //Displacements of the perfect hash
+__thread int *probe_baseptr; //Fallback probe table
+__thread unsigned int kvs_generation = UINT_MAX; //Generation of the tables the pointers above refer to, none yet
+__thread int kvs_table_size, kvs_probe_size; //Sizes of these tables
+__thread int kvs_reader_slot = -1; //Where this thread announces kvs_generation, none yet
+
+void arena_refresh();
+void index_replace(int, int, const int *, int, const int *);
+void flush_replicas();
+int lookup_set(const char *);
+
+__thread struct KVS_stats kvs_stats; //Per thread, the receiver of the daemon events takes locks too
+
+int *ranks_of(int setnumber){
+	return (int *)(arena_baseptr + entries_baseptr[setnumber].ranks_off);
+}
+
+int *updates_of(int setnumber){
+	return (int *)(arena_baseptr + entries_baseptr[setnumber].updates_off);
+}
+
+struct KVS_delta *log_of(int setnumber){
+	return (struct KVS_delta *)(arena_baseptr + entries_baseptr[setnumber].log_off);
+}
+
+struct KVS_watch *watch_of(int setnumber){
+	return (struct KVS_watch *)(arena_baseptr + entries_baseptr[setnumber].watch_off);
+}
+
+//Ranks sorted strictly ascending can be stored as ranges or bitmap, 
+//otherwise the order matters and only an explicit list keeps it
+bool ranks_sorted(int num_ranks, const int *ranks){
+	for(int i = 0; i < num_ranks; i++){
+		if(ranks[i] < 0 || (i > 0 && ranks[i] <= ranks[i-1]))
+			return false;
+	}
+	return true;
+}
+
+//Number of ints needed to store the ranks in the given encoding
+int encoded_length(int rep, int num_ranks, const int *ranks){
+	switch(rep){
+	case KVS_REP_RANGES:{
+		int num_ranges = num_ranks > 0 ? 1 : 0;
+		for(int i = 1; i < num_ranks; i++)
+			if(ranks[i] != ranks[i-1] + 1) num_ranges++;
+		return 2 * num_ranges;
+	}
+	case KVS_REP_BITMAP:
+		if(num_ranks == 0) return 1;
+		return 1 + (ranks[num_ranks-1] - ranks[0]) / 32 + 1;
+	default:
+		return num_ranks;
+	}
+}
+
+//Pick the smallest encoding that keeps the order of the ranks
+int choose_rep(int num_ranks, const int *ranks, int *len){
+	int rep = KVS_REP_LIST;
+	*len = num_ranks;
+	if(!ranks_sorted(num_ranks, ranks))
+		return rep;
+	
+	int ranges = encoded_length(KVS_REP_RANGES, num_ranks, ranks);
+	int bitmap = encoded_length(KVS_REP_BITMAP, num_ranks, ranks);
+	if(ranges < *len){
+		rep = KVS_REP_RANGES;
+		*len = ranges;
+	}
+	if(bitmap < *len){
+		rep = KVS_REP_BITMAP;
+		*len = bitmap;
+	}
+	return rep;
+}
+
+//Ranges are stored as pairs of lower and upper bound, the bitmap as the 
+//first rank followed by one bit per rank from there on
+void encode_ranks(int rep, int num_ranks, const int *ranks, int *out){
+	switch(rep){
+	case KVS_REP_RANGES:{
+		int n = 0;
+		for(int i = 0; i < num_ranks; i++){
+			if(i == 0 || ranks[i] != ranks[i-1] + 1){
+				if(i > 0) out[n++] = ranks[i-1];
+				out[n++] = ranks[i];
+			}
+		}
+		if(num_ranks > 0) out[n++] = ranks[num_ranks-1];
+		break;
+	}
+	case KVS_REP_BITMAP:{
+		int len = encoded_length(KVS_REP_BITMAP, num_ranks, ranks);
+		unsigned int *words = (unsigned int *)(out + 1);
+		out[0] = num_ranks > 0 ? ranks[0] : 0;
+		memset(words, 0, sizeof(int) * (len - 1));
+		for(int i = 0; i < num_ranks; i++){
+			int bit = ranks[i] - out[0];
+			words[bit / 32] |= 1u << (bit % 32);
+		}
+		break;
+	}
+	default:
+		memcpy(out, ranks, sizeof(int) * num_ranks);
+	}
+}
+
+//Writes at most num_ranks ranks, so torn reads can not overflow ranks. 
+//Returns the number of ranks written
+int expand_ranks(int rep, const int *data, int len, int num_ranks, int *ranks){
+	int n = 0;
+	switch(rep){
+	case KVS_REP_RANGES:
+		for(int i = 0; i + 1 < len && n < num_ranks; i += 2)
+			for(int r = data[i]; r <= data[i+1] && n < num_ranks; r++)
+				ranks[n++] = r;
+		break;
+	case KVS_REP_BITMAP:{
+		const unsigned int *words = (const unsigned int *)(data + 1);
+		for(int w = 0; w < len - 1 && n < num_ranks; w++)
+			for(int b = 0; b < 32 && n < num_ranks; b++)
+				if(words[w] & (1u << b)) ranks[n++] = data[0] + 32 * w + b;
+		break;
+	}
+	default:
+		for(; n < num_ranks && n < len; n++)
+			ranks[n] = data[n];
+	}
+	return n;
+}
+
+bool encoded_contains(int rep, const int *data, int len, int rank){
+	switch(rep){
+	case KVS_REP_RANGES:{
+		//Binary search over the ranges
+		int lo = 0, hi = len/2 - 1;
+		while(lo <= hi){
+			int mid = (lo + hi) / 2;
+			if(rank < data[2*mid]) hi = mid - 1;
+			else if(rank > data[2*mid+1]) lo = mid + 1;
+			else return true;
+		}
+		return false;
+	}
+	case KVS_REP_BITMAP:{
+		int bit = rank - data[0];
+		if(bit < 0 || bit / 32 >= len - 1) return false;
+		return (((const unsigned int *)(data + 1))[bit / 32] >> (bit % 32)) & 1;
+	}
+	default:
+		for(int i = 0; i < len; i++)
+			if(data[i] == rank) return true;
+		return false;
+	}
+}
+
+const struct KVS_delta *view_delta(const struct KVS_view *view, int i){
+	return view->log + (view->log_first + i) % KVS_LOG_SIZE;
+}
+
+//Adds and deletes of a rank alternate, so the first and the last pending delta of a 
+//rank tell whether it is in the ranks block and whether it is in the set now. 
+//Returns the index of the first delta of the rank, -1 if there is none
+int pending_ops(const struct KVS_view *view, int rank, int *first, int *last){
+	int index = -1;
+	for(int i = 0; i < view->num_deltas; i++){
+		const struct KVS_delta *d = view_delta(view, i);
+		if(d->rank != rank) continue;
+		if(index < 0){
+			index = i;
+			*first = d->op;
+		}
+		*last = d->op;
+	}
+	return index;
+}
+
+//Describe the entry as it is right now, the caller makes sure it is consistent
+void entry_view(int pos, struct KVS_view *view){
+	view->setnumber = pos;
+	view->num_ranks = entries_baseptr[pos].num_ranks;
+	view->base_num_ranks = entries_baseptr[pos].base_num_ranks;
+	view->version = entries_baseptr[pos].version;
+	view->rep = entries_baseptr[pos].rep;
+	view->len = entries_baseptr[pos].rep_len;
+	view->data = (const int *)(arena_baseptr + entries_baseptr[pos].ranks_off);
+	view->log = log_of(pos);
+	view->num_deltas = entries_baseptr[pos].num_pending;
+	view->log_first = entries_baseptr[pos].log_count - view->num_deltas;
+}
 
 void debug_print_KVS(bool isSpawned){
 	char to_print[2048]; //Quick'n'dirty, should be enough
@@ -60,6 +393,7 @@ void debug_print_KVS(bool isSpawned){
 	for(int r = 0; r < mpi_world_size; r++){
 		if(mpi_world_rank==r){
 			sem_wait(&(head_baseptr->sem));
+			arena_refresh();
 			
 			pos += sprintf(pos, "KVS %i: Debug printout, isSpawnend: %i, numEntries: %i, version: %i\n", mpi_world_rank, isSpawned, head_baseptr->num_entries, head_baseptr->version);
 			
@@ -67,11 +401,16 @@ void debug_print_KVS(bool isSpawned){
 				pos += sprintf(pos, 
 					"entry: %i, key_length: %i, key: %s, version: %i, nranks: %i, memranks: %i\n", 
 					i, entries_baseptr[i].key_length, entries_baseptr[i].key, entries_baseptr[i].version, entries_baseptr[i].num_ranks, entries_baseptr[i].mem_ranks);
-				pos += sprintf(pos, "ranks: ");
+				pos += sprintf(pos, "ranks (rep %i): ", entries_baseptr[i].rep);
+				struct KVS_view view;
+				entry_view(i, &view);
+				int *ranks = malloc(sizeof(int) * entries_baseptr[i].num_ranks + 1);
+				KVS_view_expand(&view, ranks);
 				for(int j = 0; j < entries_baseptr[i].num_ranks; j++){
-					int val = ranks_baseptr[i][j];
+					int val = ranks[j];
 					pos += sprintf(pos, "%i ", val);
 				}
+				free(ranks);
 				pos += sprintf(pos, "\n");
 			}
 		
@@ -83,486 +422,2665 @@ void debug_print_KVS(bool isSpawned){
 	}
 }
 
-//Very primitive, find better one
-int hash(const char* s, int m){
-	int r = 7;
+//FNV-1a, the seed allows to derive independent hash functions
+unsigned int hash_seeded(const char* s, unsigned int seed){
+	unsigned int r = 2166136261u ^ seed;
 	while(*s!=0){
-		r = r*31 + *s;
+		r ^= (unsigned char)*s;
+		r *= 16777619u;
 		s++;
 	}
-	return abs(r) % m;
+	r ^= r >> 15; //FNV mixes the last characters badly
+	r *= 0x2c1b3c6d;
+	r ^= r >> 12;
+	return r;
 }
 
-int locate_set(const char *key){
-	int pos = hash(key, head_baseptr->num_entries);
+int hash(const char* s, int m){
+	return hash_seeded(s, 0) % m;
+}
+
+//Slot of a key in the minimal perfect hash, only meaningful for keys known at KVS_initialise
+int mph_slot(const char *key){
+	int bucket = hash_seeded(key, 0) % head_baseptr->mph_buckets;
+	return hash_seeded(key, mph_baseptr[bucket]) % head_baseptr->mph_size;
+}
+
+//Perfect hash + one key comparison, sets added later are found in the probe table
+int find_set(const char *key){
+	kvs_stats.lookups++;
+	kvs_stats.probes++;
+	int pos = mph_slot(key);
+	if(strcmp(key, entries_baseptr[pos].key)==0)
+		return pos;
 	
-	int n = pos;
-	do{
-		if(strcmp(key, entries_baseptr[n].key)==0)
-			return n;
-		n = (n + 1) % head_baseptr->num_entries;
-	}while(n!=pos);
+	int mask = kvs_probe_size - 1;
+	int n = hash_seeded(key, KVS_PROBE_SEED) & mask;
+	for(int i = 0; i < kvs_probe_size; i++, n = (n + 1) & mask){
+		int id = __atomic_load_n(&(probe_baseptr[n]), __ATOMIC_ACQUIRE);
+		if(id == KVS_PROBE_EMPTY)
+			break;
+		if(id < 0 || id >= kvs_table_size) //Deleted
+			continue;
+		kvs_stats.probes++;
+		if(strcmp(key, entries_baseptr[id].key)==0)
+			return id;
+	}
 	
-	printf("KVS %i: DID NOT FIND\n", mpi_world_rank);
 	return -1;
 }
 
-int num_digits(int n){
-	int ret = 1;
-	while((n/=10) != 0) ret++;
-	return ret;
+//A set created while the tables moved may be missing from the ones we searched, 
+//then the lookup is repeated on the new tables
+int locate_set_quiet(const char *key){
+	for(;;){
+		arena_refresh();
+		unsigned int generation = kvs_generation;
+		int pos = find_set(key);
+		if(pos >= 0 || __atomic_load_n(&(head_baseptr->generation), __ATOMIC_ACQUIRE) == generation)
+			return pos;
+	}
+}
+
+int locate_set(const char *key){
+	int pos = locate_set_quiet(key);
+	if(pos < 0)
+		printf("KVS %i: DID NOT FIND\n", mpi_world_rank);
+	return pos;
+}
+
+//Caller holds the global lock and made sure there is a free slot
+void probe_table_insert(const char *key, int pos){
+	int mask = head_baseptr->probe_size - 1;
+	int n = hash_seeded(key, KVS_PROBE_SEED) & mask;
+	for(int i = 0; i < head_baseptr->probe_size; i++, n = (n + 1) & mask){
+		if(probe_baseptr[n] == KVS_PROBE_EMPTY){
+			head_baseptr->probe_used++;
+			__atomic_store_n(&(probe_baseptr[n]), pos, __ATOMIC_RELEASE);
+			return;
+		}
+		if(probe_baseptr[n] == KVS_PROBE_DELETED){
+			__atomic_store_n(&(probe_baseptr[n]), pos, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+	
+	printf("KVS %i: probe table is full, exiting\n", mpi_world_rank);
+	exit(-1);
+}
+
+void probe_table_remove(int pos){
+	for(int i = 0; i < head_baseptr->probe_size; i++){
+		if(probe_baseptr[i] == pos)
+			__atomic_store_n(&(probe_baseptr[i]), KVS_PROBE_DELETED, __ATOMIC_RELEASE);
+	}
+}
+
+//Finds displacements such that every key lands in its own slot in [0, num_keys).
+//Buckets are placed largest first, returns false if one could not be placed.
+bool mph_try_build(char **keys, int num_keys, int num_buckets, int *displacements){
+	int *bucket_of = malloc(sizeof(int) * num_keys);
+	int *bucket_size = calloc(num_buckets, sizeof(int));
+	int *bucket_start = calloc(num_buckets + 1, sizeof(int));
+	int *sorted = malloc(sizeof(int) * num_keys);
+	int *order = malloc(sizeof(int) * num_buckets);
+	int *slots = malloc(sizeof(int) * num_keys);
+	bool *taken = calloc(num_keys, sizeof(bool));
+	bool ok = true;
+	
+	for(int i = 0; i < num_keys; i++){
+		bucket_of[i] = hash_seeded(keys[i], 0) % num_buckets;
+		bucket_size[bucket_of[i]]++;
+	}
+	for(int b = 0; b < num_buckets; b++)
+		bucket_start[b+1] = bucket_start[b] + bucket_size[b];
+	int *fill = calloc(num_buckets, sizeof(int));
+	for(int i = 0; i < num_keys; i++)
+		sorted[bucket_start[bucket_of[i]] + fill[bucket_of[i]]++] = i;
+	free(fill);
+	
+	//Counting sort of the buckets by size, descending
+	int max_size = 0;
+	for(int b = 0; b < num_buckets; b++)
+		if(bucket_size[b] > max_size) max_size = bucket_size[b];
+	int num_order = 0;
+	for(int size = max_size; size > 0; size--)
+		for(int b = 0; b < num_buckets; b++)
+			if(bucket_size[b] == size) order[num_order++] = b;
+	
+	for(int b = 0; b < num_buckets; b++)
+		displacements[b] = 0;
+	
+	long max_tries = 64L * num_keys + 1024;
+	for(int o = 0; o < num_order && ok; o++){
+		int b = order[o];
+		int *members = sorted + bucket_start[b];
+		bool placed = false;
+		
+		for(long d = 1; d < max_tries && !placed; d++){
+			placed = true;
+			for(int k = 0; k < bucket_size[b] && placed; k++){
+				slots[k] = hash_seeded(keys[members[k]], d) % num_keys;
+				if(taken[slots[k]]) placed = false;
+				for(int j = 0; j < k && placed; j++)
+					if(slots[j] == slots[k]) placed = false;
+			}
+			if(placed){
+				displacements[b] = d;
+				for(int k = 0; k < bucket_size[b]; k++)
+					taken[slots[k]] = true;
+			}
+		}
+		ok = placed;
+	}
+	
+	free(bucket_of);
+	free(bucket_size);
+	free(bucket_start);
+	free(sorted);
+	free(order);
+	free(slots);
+	free(taken);
+	return ok;
+}
+
+//Returns the number of buckets, displacements has to be freed by the user
+int mph_build(char **keys, int num_keys, int **displacements){
+	int num_buckets = num_keys/2 + 1;
+	for(;;){
+		*displacements = malloc(sizeof(int) * num_buckets);
+		if(mph_try_build(keys, num_keys, num_buckets, *displacements))
+			return num_buckets;
+		free(*displacements);
+		num_buckets *= 2;
+	}
+}
+
+MPI_Win kvs_window = MPI_WIN_NULL; //Holds the arena instead of a POSIX shared memory object, see KVS_Use_window
+size_t kvs_window_size = 0;
+
+//Keep the arena in a shared MPI window of window_size bytes (KVS_WINDOW_SIZE if 0) of 
+//the ranks in node_comm instead of a POSIX shared memory object, collective over 
+//node_comm before KVS_initialise and KVS_open. Rank 0 of node_comm allocates the 
+//window, the others access it directly. The arena cannot grow beyond the window, 
+//processes spawned later cannot attach to it and KVS_free is collective over node_comm
+void KVS_Use_window(MPI_Comm node_comm, size_t window_size){
+	int node_rank, disp_unit;
+	MPI_Aint size;
+	void *base;
+	
+	if(window_size == 0)
+		window_size = KVS_WINDOW_SIZE;
+	MPI_Comm_rank(node_comm, &node_rank);
+	MPI_Win_allocate_shared(node_rank == 0 ? window_size : 0, 1, MPI_INFO_NULL, node_comm, &base, &kvs_window);
+	MPI_Win_shared_query(kvs_window, 0, &size, &disp_unit, &base);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, kvs_window);
+	arena_baseptr = base;
+	kvs_window_size = size;
+}
+
+//Whether the window still holds size more bytes, writers check it before they take a 
+//lock, so a full window fails the call instead of the process. Always true without 
+//a window
+bool window_has_room(size_t size){
+	if(kvs_window == MPI_WIN_NULL)
+		return true;
+	return __atomic_load_n(&(head_baseptr->arena_used), __ATOMIC_ACQUIRE) + size <= kvs_window_size;
+}
+
+void window_full(){
+	printf("KVS %i: the window of %lu bytes is full, raise MPI_SESSIONS_WINDOW_SIZE, exiting\n", mpi_world_rank, kvs_window_size);
+	exit(-1);
+}
+
+char *arena_name(){
+	char *tmp = malloc(strlen(program_identifier) + strlen(arena_identifier) + 1);
+	strcpy(tmp, program_identifier);
+	strcat(tmp, arena_identifier);
+	return tmp;
+}
+
+//Recompute the pointers to the structures in the arena
+void arena_set_pointers(){
+	head_baseptr = (struct KVS_head *)arena_baseptr;
+	entries_baseptr = (struct KVS_entry *)(arena_baseptr + head_baseptr->entries_off);
+	mph_baseptr = (int *)(arena_baseptr + head_baseptr->mph_off);
+	probe_baseptr = (int *)(arena_baseptr + head_baseptr->probe_off);
+	kvs_table_size = head_baseptr->table_size;
+	kvs_probe_size = head_baseptr->probe_size;
+}
+
+//Tell writers that this thread only uses the tables of generation gen from now on
+void announce_generation(unsigned int gen){
+	if(kvs_reader_slot == -1)
+		kvs_reader_slot = __atomic_fetch_add(&(head_baseptr->num_readers), 1, __ATOMIC_SEQ_CST);
+	if(kvs_reader_slot < KVS_READER_SLOTS)
+		__atomic_store_n(&(head_baseptr->readers[kvs_reader_slot]), gen, __ATOMIC_SEQ_CST);
 }
 
-//Build the name to identify a shared memory region for ranks/updates
-//Out has to be freed by user
-void construct_name(int setnumber, const char *postfix, char **out){
-	int nsetnumber = num_digits(setnumber);
+//The thread reads no more tables, e.g. before it ends
+void leave_generation(){
+	if(kvs_reader_slot >= 0 && kvs_reader_slot < KVS_READER_SLOTS)
+		__atomic_store_n(&(head_baseptr->readers[kvs_reader_slot]), UINT_MAX, __ATOMIC_SEQ_CST);
+}
+
+//Pick up tables that were moved by another process, called before every lookup. 
+//Replaced tables are only freed once every thread announced a later generation, so 
+//readers that raced with the growth are safe
+void arena_refresh(){
+	unsigned int gen = __atomic_load_n(&(head_baseptr->generation), __ATOMIC_ACQUIRE);
+	if(gen == kvs_generation)
+		return;
+	
+	do{
+		while((gen = __atomic_load_n(&(head_baseptr->generation), __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		arena_set_pointers();
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}while(__atomic_load_n(&(head_baseptr->generation), __ATOMIC_RELAXED) != gen);
+	kvs_generation = gen;
+	announce_generation(gen);
+}
+
+//True if [offset, offset+size) lies within the arena, used to reject torn reads
+bool arena_contains(size_t offset, size_t size){
+	size_t arena_size = __atomic_load_n(&(head_baseptr->arena_size), __ATOMIC_ACQUIRE);
+	return offset <= arena_size && size <= arena_size - offset;
+}
+
+//The whole reserve is mapped once, growing the arena only extends the shared 
+//memory object, so nobody has to remap and pointers stay valid
+void map_arena(int fd){
+	if((arena_baseptr = mmap(NULL, KVS_ARENA_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0)) == ((void *) -1)){
+		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
+		perror("mmap encountered: ");
+		exit(-1);
+	}
+	arena_set_pointers();
+}
+
+//The arena is named after the job, so an object of the same name can only be left by a 
+//crashed run. It is stale once the process that created it is gone
+bool arena_stale(const char *name){
+	struct stat st;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd == -1)
+		return errno == ENOENT;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct KVS_head)){
+		close(fd);
+		return true; //Its creator did not even get to size it
+	}
+	struct KVS_head *head = mmap(NULL, sizeof(struct KVS_head), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(head == MAP_FAILED)
+		return false;
+	pid_t owner = head->owner;
+	munmap(head, sizeof(struct KVS_head));
+	return owner <= 0 || (kill(owner, 0) == -1 && errno == ESRCH);
+}
+
+void allocate_arena(size_t size){
+	if(kvs_window != MPI_WIN_NULL){
+		if(size > kvs_window_size)
+			window_full();
+		memset(arena_baseptr, 0, size);
+		arena_set_pointers();
+		head_baseptr->arena_size = size;
+		head_baseptr->arena_used = (sizeof(struct KVS_head) + 63) & ~(size_t)63;
+		return;
+	}
+	
+	//An object left behind by a crashed run is removed, so the arena always starts 
+	//from fresh pages, which are zero and need no memset
+	char *tmp = arena_name();
+	int fd = shm_open(tmp, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if(fd == -1 && errno == EEXIST && arena_stale(tmp)){
+		shm_unlink(tmp);
+		fd = shm_open(tmp, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	}
+	if(fd == -1){
+		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
+		perror("shm_open encountered: ");
+		exit(-1);
+	}
+	if(ftruncate(fd, size) == -1){
+		printf("KVS %i: ftruncate failed, exiting\n", mpi_world_rank);
+		perror("ftruncate encountered: ");
+		exit(-1);
+	}
+	map_arena(fd);
+	close(fd);
+	free(tmp);
 	
-	*out = malloc(nsetnumber + strlen(postfix) + strlen(program_identifier) + 5);
-	sprintf(*out, "%s_%i_%s", program_identifier, setnumber, postfix);
+	head_baseptr->owner = getpid();
+	head_baseptr->arena_size = size;
+	head_baseptr->arena_used = (sizeof(struct KVS_head) + 63) & ~(size_t)63;
 }
 
-void open_memory_block(int setnumber, const char *postfix, int **memory, size_t size){
-	char *tmp;
-	construct_name(setnumber, postfix, &tmp);
+void open_arena(){
+	if(kvs_window != MPI_WIN_NULL){
+		arena_set_pointers();
+		return;
+	}
+	
+	char *tmp = arena_name();
 	int fd;
 	if((fd = shm_open(tmp, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
 		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
 		perror("shm_open encountered: ");
 		exit(-1);
 	}
-	if((*memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == ((void *) -1)){
-		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
+	map_arena(fd);
+	close(fd);
+	free(tmp);
+}
+
+//Collective over the node with the window backend, every process of the node has to 
+//free the KVS, otherwise MPI_Win_free does not return
+void deallocate_arena(){
+	if(kvs_window != MPI_WIN_NULL){
+		MPI_Win_unlock_all(kvs_window);
+		MPI_Win_free(&kvs_window);
+		return;
+	}
+	
+	if(munmap(arena_baseptr, KVS_ARENA_RESERVE) == -1){
+		printf("KVS %i: munmap failed, exiting...\n", mpi_world_rank);
+		perror("munmap encountered: ");
 		exit(-1);
 	}
-	close(fd);
+	char *tmp = arena_name();
+	shm_unlink(tmp);
 	free(tmp);
 }
 
-void allocate_memory_block(int setnumber, const char *postfix, int **memory, size_t size){
-	char *tmp;
-	construct_name(setnumber, postfix, &tmp);
+//Caller holds the allocator lock
+void grow_arena(size_t min_size){
+	size_t size = head_baseptr->arena_size;
+	while(size < min_size) size *= 2;
+	if(size > KVS_ARENA_RESERVE){
+		printf("KVS %i: arena exceeds its reserve of %lu bytes, exiting\n", mpi_world_rank, KVS_ARENA_RESERVE);
+		exit(-1);
+	}
+	
+	if(kvs_window != MPI_WIN_NULL){
+		if(size > kvs_window_size)
+			window_full();
+		memset(arena_baseptr + head_baseptr->arena_size, 0, size - head_baseptr->arena_size);
+		__atomic_store_n(&(head_baseptr->arena_size), size, __ATOMIC_RELEASE);
+		return;
+	}
+	
+	char *tmp = arena_name();
 	int fd;
-	if((fd = shm_open(tmp, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
+	if((fd = shm_open(tmp, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
 		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
 		perror("shm_open encountered: ");
 		exit(-1);
 	}
-	ftruncate(fd, size);
-	if((*memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == ((void *) -1)){
-		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
+	if(ftruncate(fd, size) == -1){
+		printf("KVS %i: ftruncate failed, exiting\n", mpi_world_rank);
+		perror("ftruncate encountered: ");
 		exit(-1);
 	}
-	memset(*memory, 0, size); 
 	close(fd);
 	free(tmp);
+	
+	__atomic_store_n(&(head_baseptr->arena_size), size, __ATOMIC_RELEASE);
 }
 
-void open_ranks_and_updates(){
-	ranks_baseptr = malloc(head_baseptr->num_entries * sizeof(int*));
-	updates_baseptr = malloc(head_baseptr->num_entries * sizeof(int*));
+int size_class(size_t size){
+	int c = KVS_ARENA_MIN_CLASS;
+	while(((size_t)1 << c) < size) c++;
+	return c;
+}
 
-	for(int i = 0; i < head_baseptr->num_entries; i++){
-		open_memory_block(i, "ranks", &(ranks_baseptr[i]), 
-			entries_baseptr[i].mem_ranks * sizeof(int));
-		open_memory_block(i, "updates", &(updates_baseptr[i]), 
-			entries_baseptr[i].mem_updates * sizeof(int));
+//Returns the offset of a block of at least size bytes, blocks are power of two 
+//sized and recycled through one free list per size
+size_t arena_alloc(size_t size){
+	int c = size_class(size);
+	
+	sem_wait(&(head_baseptr->arena_sem));
+	size_t offset = head_baseptr->free_lists[c];
+	if(offset != 0){
+		head_baseptr->free_lists[c] = *(size_t *)(arena_baseptr + offset);
 	}
+	else{
+		offset = head_baseptr->arena_used;
+		if(offset + ((size_t)1 << c) > head_baseptr->arena_size)
+			grow_arena(offset + ((size_t)1 << c));
+		head_baseptr->arena_used = offset + ((size_t)1 << c);
+	}
+	sem_post(&(head_baseptr->arena_sem));
+	
+	return offset;
 }
 
-void allocate_ranks_and_updates(){
-	ranks_baseptr = malloc(head_baseptr->num_entries * sizeof(int*));
-	updates_baseptr = malloc(head_baseptr->num_entries * sizeof(int*));
+//Lock-free readers might still look at the block, they detect this by the 
+//sequence counter of their entry
+void arena_free(size_t offset, size_t size){
+	if(offset == 0)
+		return;
+	int c = size_class(size);
 	
+	sem_wait(&(head_baseptr->arena_sem));
+	*(size_t *)(arena_baseptr + offset) = head_baseptr->free_lists[c];
+	head_baseptr->free_lists[c] = offset;
+	sem_post(&(head_baseptr->arena_sem));
+}
+
+//The ranks blocks are allocated when the sets are put
+void allocate_updates_and_logs(){
 	for(int i = 0; i < head_baseptr->num_entries; i++){
-		//I'm mapping enough space for all processes, according to SO this is only virtual memory TODO: Check if it isn't to much anyway
-		int size = mpi_world_size;
+		//Start small, blocks grow on demand
+		int size = KVS_MIN_BLOCK;
 		
-		allocate_memory_block(i, "ranks", &(ranks_baseptr[i]), size * sizeof(int));
-		allocate_memory_block(i, "updates", &(updates_baseptr[i]), size * sizeof(int));
+		entries_baseptr[i].updates_off = arena_alloc(size * sizeof(int));
+		entries_baseptr[i].log_off = arena_alloc(KVS_LOG_SIZE * sizeof(struct KVS_delta));
+		entries_baseptr[i].watch_off = arena_alloc(sizeof(struct KVS_watch));
 		
 		//Save size information
-		entries_baseptr[i].mem_ranks = size;
 		entries_baseptr[i].mem_updates = size;
 	}
 }
 
-//Works also for blocks from open_memory_block
-void deallocate_memory_block(int setnumber, const char *postfix, int *memory, size_t size){
-	munmap(memory, size);
-	char *tmp;
-	construct_name(setnumber, postfix, &tmp);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, "_kvs");
-	shm_unlink(tmp);
-	free(tmp);
-}
-
-//Works also for if open_ranks_and_updates was used
-void deallocate_ranks_and_updates(){
-	for(int i = 0; i < head_baseptr->num_entries; i++){
-		deallocate_memory_block(i, "ranks", ranks_baseptr[i], entries_baseptr[i].mem_ranks * sizeof(int));
-		deallocate_memory_block(i, "updates", updates_baseptr[i], entries_baseptr[i].mem_updates * sizeof(int));
+void KVS_intern_create_lock(){
+	if(sem_init(&head_baseptr->sem, 1, 1) == -1){
+		printf("KVS %i: sem_init failed, exiting...\n", mpi_world_rank);
+		perror("sem_init encountered: ");
+	}
+	if(sem_init(&head_baseptr->arena_sem, 1, 1) == -1){
+		printf("KVS %i: sem_init failed, exiting...\n", mpi_world_rank);
+		perror("sem_init encountered: ");
+	}
+	for(int i = 0; i < KVS_LOCK_STRIPES; i++){
+		if(sem_init(&(head_baseptr->stripes[i]), 1, 1) == -1){
+			printf("KVS %i: sem_init failed, exiting...\n", mpi_world_rank);
+			perror("sem_init encountered: ");
+		}
 	}
-	
-	free(ranks_baseptr);
-	free(updates_baseptr);
 }
 
-void open_KVS_head(){
-	char *tmp = malloc(strlen(program_identifier) + strlen(head_identifier) + 1);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, head_identifier);
-	int fd;
-	if((fd = shm_open(tmp, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
-		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
-		perror("shm_open encountered: ");
-		exit(-1);
+void KVS_intern_destroy_lock(){
+	if(sem_destroy(&(head_baseptr->sem)) == -1){
+		printf("KVS %i: sem_destroy failed, exiting...\n", mpi_world_rank);
+		perror("sem_destroy encountered: ");
 	}
-	size_t size = sizeof(struct KVS_head);
-	if((head_baseptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == ((void *) -1)){
-		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
-		perror("mmap encountered: ");
-		exit(-1);
+	if(sem_destroy(&(head_baseptr->arena_sem)) == -1){
+		printf("KVS %i: sem_destroy failed, exiting...\n", mpi_world_rank);
+		perror("sem_destroy encountered: ");
+	}
+	for(int i = 0; i < KVS_LOCK_STRIPES; i++){
+		if(sem_destroy(&(head_baseptr->stripes[i])) == -1){
+			printf("KVS %i: sem_destroy failed, exiting...\n", mpi_world_rank);
+			perror("sem_destroy encountered: ");
+		}
 	}
-	close(fd);
-	free(tmp);
 }
 
-void allocate_KVS_head(){
-	char *tmp = malloc(strlen(program_identifier) + strlen(head_identifier) + 1);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, head_identifier);
-	int fd;
-	if((fd = shm_open(tmp, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
-		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
-		perror("shm_open encountered: ");
-		exit(-1);
+__thread double kvs_lock_since, kvs_stripe_since[KVS_LOCK_STRIPES]; //When this thread took the locks
+
+//Monotonic seconds, unlike MPI_Wtime usable from any thread
+double kvs_clock(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void count_lock_hold(double since){
+	kvs_stats.lock_holds++;
+	kvs_stats.lock_time += kvs_clock() - since;
+}
+
+//Lock holders always work on the current tables
+int KVS_intern_lock(){
+	int ret = sem_wait(&head_baseptr->sem);
+	kvs_lock_since = kvs_clock();
+	arena_refresh();
+	return ret;
+}
+
+int KVS_intern_unlock(){
+	count_lock_hold(kvs_lock_since);
+	return sem_post(&head_baseptr->sem);
+}
+
+//The stripe only depends on the name, so it stays the same if the table changes
+int KVS_intern_stripe(const char *key){
+	return hash(key, KVS_LOCK_STRIPES);
+}
+
+int KVS_intern_lock_set(const char *key){
+	int stripe = KVS_intern_stripe(key);
+	int ret = sem_wait(&(head_baseptr->stripes[stripe]));
+	kvs_stripe_since[stripe] = kvs_clock();
+	arena_refresh();
+	return ret;
+}
+
+int KVS_intern_unlock_set(const char *key){
+	int stripe = KVS_intern_stripe(key);
+	count_lock_hold(kvs_stripe_since[stripe]);
+	return sem_post(&(head_baseptr->stripes[stripe]));
+}
+
+//Writers (holding the lock) bracket every modification of an entry with these
+void write_seq_begin(int setnumber){
+	unsigned int seq = entries_baseptr[setnumber].seq;
+	__atomic_store_n(&(entries_baseptr[setnumber].seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_seq_end(int setnumber){
+	unsigned int seq = entries_baseptr[setnumber].seq;
+	__atomic_store_n(&(entries_baseptr[setnumber].seq), seq + 1, __ATOMIC_RELEASE);
+}
+
+//Readers take a snapshot of the sequence counter before copying, waiting for 
+//running writers to finish, and retry if it changed afterwards
+unsigned int read_seq_begin(int setnumber){
+	unsigned int seq;
+	while((seq = __atomic_load_n(&(entries_baseptr[setnumber].seq), __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+	return seq;
+}
+
+bool read_seq_retry(int setnumber, unsigned int seq){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(entries_baseptr[setnumber].seq), __ATOMIC_RELAXED) != seq;
+}
+
+void free_snapshot(struct KVS_snapshot *snapshot){
+	arena_free(snapshot->offset, snapshot->mem * sizeof(int));
+	snapshot->offset = 0;
+	snapshot->mem = 0;
+	snapshot->pins = 0;
+}
+
+//Encode the ranks into a new block
+void store_snapshot(struct KVS_snapshot *snapshot, int version, int num_ranks, const int *ranks){
+	int len;
+	snapshot->rep = choose_rep(num_ranks, ranks, &len);
+	snapshot->mem = len > KVS_MIN_BLOCK ? len : KVS_MIN_BLOCK;
+	snapshot->offset = arena_alloc(snapshot->mem * sizeof(int));
+	encode_ranks(snapshot->rep, num_ranks, ranks, (int *)(arena_baseptr + snapshot->offset));
+	snapshot->version = version;
+	snapshot->num_ranks = num_ranks;
+	snapshot->rep_len = len;
+}
+
+//Encode the ranks into a new block of the set, has to be called inside write_seq_begin/end. 
+//The old block goes to the history of the set, the oldest one there is freed
+void store_ranks(int setnumber, int num_ranks, const int *ranks){
+	struct KVS_entry *entry = &entries_baseptr[setnumber];
+	if(entry->ranks_off != 0){
+		if(entry->num_history == KVS_HISTORY)
+			free_snapshot(&entry->history[--entry->num_history]);
+		memmove(&entry->history[1], &entry->history[0], sizeof(struct KVS_snapshot) * entry->num_history);
+		entry->history[0] = (struct KVS_snapshot){entry->base_version, entry->base_num_ranks, 
+			entry->rep, entry->rep_len, entry->mem_ranks, 0, entry->ranks_off};
+		entry->num_history++;
+	}
+	
+	struct KVS_snapshot block;
+	store_snapshot(&block, entry->version, num_ranks, ranks);
+	entry->ranks_off = block.offset;
+	entry->mem_ranks = block.mem;
+	entry->rep = block.rep;
+	entry->rep_len = block.rep_len;
+	entry->num_ranks = num_ranks;
+	entry->base_num_ranks = num_ranks;
+	entry->base_version = entry->version;
+}
+
+//Record a change of the set, has to be called inside write_seq_begin/end after 
+//the version was increased
+void log_append(int setnumber, int op, int rank){
+	struct KVS_delta *d = log_of(setnumber) + entries_baseptr[setnumber].log_count % KVS_LOG_SIZE;
+	d->version = entries_baseptr[setnumber].version;
+	d->op = op;
+	d->rank = rank;
+	entries_baseptr[setnumber].log_count++;
+}
+
+//Fold the pending deltas into the ranks block, inside write_seq_begin/end
+void compact_log(int setnumber){
+	struct KVS_view view;
+	entry_view(setnumber, &view);
+	int *ranks = malloc(sizeof(int) * view.num_ranks + 1);
+	int num_ranks = KVS_view_expand(&view, ranks);
+	store_ranks(setnumber, num_ranks, ranks);
+	entries_baseptr[setnumber].num_pending = 0;
+	free(ranks);
+}
+
+int rescale_memory_updates(int setnumber, int old_mem, int new_mem){
+	size_t old_off = entries_baseptr[setnumber].updates_off;
+	size_t new_off = arena_alloc(new_mem*sizeof(int));
+	memcpy(arena_baseptr + new_off, arena_baseptr + old_off, entries_baseptr[setnumber].num_updates*sizeof(int));
+	entries_baseptr[setnumber].updates_off = new_off;
+	entries_baseptr[setnumber].mem_updates = new_mem;
+	arena_free(old_off, old_mem*sizeof(int));
+	return 0;
+}
+
+//Write the first version of an entry, its blocks have to be allocated
+void insert_entry(int pos, char *key, int num_ranks, int *ranks, int version){
+	write_seq_begin(pos);
+	
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELEASE);
+	entries_baseptr[pos].version = version;
+	entries_baseptr[pos].created_node = -1;
+	entries_baseptr[pos].created_id = 0;
+	entries_baseptr[pos].log_count = 0;
+	entries_baseptr[pos].num_pending = 0;
+	entries_baseptr[pos].num_history = 0;
+	entries_baseptr[pos].ranks_off = 0;
+	memset(entries_baseptr[pos].pinned, 0, sizeof(entries_baseptr[pos].pinned));
+	store_ranks(pos, num_ranks, ranks);
+	
+	strcpy(entries_baseptr[pos].key, key);
+	entries_baseptr[pos].key_length = strlen(key);
+	watch_of(pos)->version = version;
+	watch_of(pos)->num_waiters = 0;
+	
+	write_seq_end(pos);
+}
+
+//Put the first version of an entry in the KVS. 
+//Keys from KVS_initialise get their slot in the perfect hash, others the next 
+//free slot and an entry in the probe table
+void KVS_Put_initial(char *key, int num_ranks, int *ranks){
+	KVS_intern_lock();
+	
+	int n = mph_slot(key);
+	if(strlen(entries_baseptr[n].key) != 0){ //TODO: Pretty hacky check
+		for(n = 0; n < head_baseptr->num_entries && strlen(entries_baseptr[n].key) != 0; n++);
+		if(n == head_baseptr->num_entries){
+			printf("KVS %i: DID NOT FIND\n", mpi_world_rank);
+			
+			//Error, no free entry
+			KVS_intern_unlock();
+			exit(-1);
+		}
+		probe_table_insert(key, n);
+	}
+	
+	insert_entry(n, key, num_ranks, ranks, 1);
+	index_replace(n, 0, NULL, num_ranks, ranks);
+	KVS_intern_unlock();
+}
+
+//The arena is shared between processes, so no FUTEX_PRIVATE_FLAG. 
+//timeout is relative, NULL waits forever
+void futex_wait(int *word, int val, const struct timespec *timeout){
+	syscall(SYS_futex, word, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+void futex_wake(int *word){
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+//Copy the new version of the set to its version word and wake the processes 
+//waiting for it, after write_seq_end
+void publish_version(int pos){
+	struct KVS_watch *watch = watch_of(pos);
+	__atomic_store_n(&(watch->version), entries_baseptr[pos].version, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(watch->num_waiters), __ATOMIC_SEQ_CST) > 0)
+		futex_wake(&(watch->version));
+}
+
+//Wake the processes waiting for a change of any set, after the watchers of the 
+//changed set were notified
+void publish_change(){
+	struct KVS_watch *watch = &(head_baseptr->changes);
+	__atomic_fetch_add(&(watch->version), 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(watch->num_waiters), __ATOMIC_SEQ_CST) > 0)
+		futex_wake(&(watch->version));
+}
+
+//Number of updates of all sets so far, pass it to KVS_Wait_change after checking 
+//the sets of interest
+int KVS_Get_change_count(){
+	return __atomic_load_n(&(head_baseptr->changes.version), __ATOMIC_ACQUIRE);
+}
+
+//Sleep until any set on this node changed after count was taken, or for at most 
+//timeout seconds if it is not negative. Returns false on timeout. 
+//Needs no MPI, so other threads may call it
+bool KVS_Wait_change(int count, double timeout){
+	struct KVS_watch *watch = &(head_baseptr->changes);
+	double end = kvs_clock() + timeout;
+	bool changed = true;
+	
+	__atomic_fetch_add(&(watch->num_waiters), 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&(watch->version), __ATOMIC_SEQ_CST) == count){
+		if(timeout < 0){
+			futex_wait(&(watch->version), count, NULL);
+			continue;
+		}
+		double left = end - kvs_clock();
+		if(left <= 0){
+			changed = false;
+			break;
+		}
+		struct timespec ts = {(time_t) left, (long) ((left - (time_t) left) * 1e9)};
+		futex_wait(&(watch->version), count, &ts);
+	}
+	__atomic_fetch_sub(&(watch->num_waiters), 1, __ATOMIC_SEQ_CST);
+	return changed;
+}
+
+//Version of the set as seen by watchers, without locking or MPI. 
+//Deleting a set changes it as well, -1 means there is no such set
+int KVS_Get_watch_version(int setnumber){
+	arena_refresh();
+	if(setnumber < 0 || setnumber >= kvs_table_size || 
+			setnumber >= __atomic_load_n(&(head_baseptr->num_entries), __ATOMIC_ACQUIRE))
+		return -1;
+	return __atomic_load_n(&(watch_of(setnumber)->version), __ATOMIC_ACQUIRE);
+}
+
+//Sleep until the version of the set is no longer version, writers on this node wake us
+void KVS_Wait_version(int setnumber, int version){
+	arena_refresh();
+	if(setnumber < 0 || setnumber >= kvs_table_size || 
+			setnumber >= __atomic_load_n(&(head_baseptr->num_entries), __ATOMIC_ACQUIRE))
+		return;
+	
+	struct KVS_watch *watch = watch_of(setnumber);
+	__atomic_fetch_add(&(watch->num_waiters), 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&(watch->version), __ATOMIC_SEQ_CST) == version)
+		futex_wait(&(watch->version), version, NULL);
+	__atomic_fetch_sub(&(watch->num_waiters), 1, __ATOMIC_SEQ_CST);
+}
+
+//Notifications are not sent while a lock is held. The watchers are copied to this 
+//thread local outbox and flush_notifications sends them once the lock is released
+struct KVS_outbox{
+	int setnumber;
+	int num_watchers;
+	int *watchers;
+};
+
+__thread struct KVS_outbox *kvs_outbox = NULL;
+__thread int kvs_outbox_len = 0, kvs_outbox_mem = 0;
+
+//Notifications in flight, their buffers are freed once the send completed
+MPI_Request *kvs_sends = NULL;
+int **kvs_send_buffers = NULL;
+int kvs_num_sends = 0, kvs_mem_sends = 0;
+pthread_mutex_t kvs_sends_lock = PTHREAD_MUTEX_INITIALIZER; //The progress thread may apply replicas and send as well
+
+struct KVS_mailbox *kvs_mailbox = NULL; //Of this process, if it has one
+
+//Events drained from the mailbox that were not handed out yet
+struct KVS_event *kvs_events = NULL;
+int kvs_events_first = 0, kvs_events_len = 0, kvs_events_mem = 0;
+
+//Writers may push concurrently, they reserve a slot by moving head. If the slot at 
+//head still holds an unread event the mailbox is full, the event is dropped then
+void mailbox_push(struct KVS_mailbox *box, const struct KVS_event *event){
+	unsigned long pos = __atomic_load_n(&(box->head), __ATOMIC_RELAXED);
+	for(;;){
+		struct KVS_slot *slot = &(box->slots[pos % KVS_MAILBOX_SIZE]);
+		unsigned long seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		if(seq == pos){
+			if(__atomic_compare_exchange_n(&(box->head), &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				slot->event = *event;
+				__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+				return;
+			}
+		}
+		else if(seq < pos){
+			__atomic_store_n(&(box->lost), 1, __ATOMIC_RELEASE);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&(box->head), __ATOMIC_RELAXED);
+	}
+}
+
+//Only called by the owner of the mailbox
+bool mailbox_pop(struct KVS_mailbox *box, struct KVS_event *event){
+	struct KVS_slot *slot = &(box->slots[box->tail % KVS_MAILBOX_SIZE]);
+	if(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != box->tail + 1)
+		return false;
+	*event = slot->event;
+	__atomic_store_n(&(slot->seq), box->tail + KVS_MAILBOX_SIZE, __ATOMIC_RELEASE);
+	box->tail++;
+	return true;
+}
+
+//Give this process a mailbox, writers then push the changes of the sets it watches 
+//there instead of sending MPI notifications
+void KVS_Open_mailbox(){
+	if(kvs_mailbox != NULL)
+		return;
+	
+	KVS_intern_lock();
+	
+	//Writers look up mailboxes while holding the lock of a set, keep them out while the directory moves
+	if(mpi_world_rank >= head_baseptr->mailboxes_size){
+		int size = 2 * head_baseptr->mailboxes_size;
+		if(size <= mpi_world_rank) size = mpi_world_rank + 1;
+		for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+			sem_wait(&(head_baseptr->stripes[i]));
+		
+		size_t offset = arena_alloc(sizeof(size_t) * size);
+		memset(arena_baseptr + offset, 0, sizeof(size_t) * size);
+		memcpy(arena_baseptr + offset, arena_baseptr + head_baseptr->mailboxes_off, sizeof(size_t) * head_baseptr->mailboxes_size);
+		arena_free(head_baseptr->mailboxes_off, sizeof(size_t) * head_baseptr->mailboxes_size);
+		head_baseptr->mailboxes_off = offset;
+		head_baseptr->mailboxes_size = size;
+		
+		for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+			sem_post(&(head_baseptr->stripes[i]));
+	}
+	
+	size_t offset = arena_alloc(sizeof(struct KVS_mailbox));
+	struct KVS_mailbox *box = (struct KVS_mailbox *)(arena_baseptr + offset);
+	box->head = 0;
+	box->tail = 0;
+	box->lost = 0;
+	for(int i = 0; i < KVS_MAILBOX_SIZE; i++)
+		box->slots[i].seq = i;
+	__atomic_store_n(&((size_t *)(arena_baseptr + head_baseptr->mailboxes_off))[mpi_world_rank], offset, __ATOMIC_RELEASE);
+	
+	KVS_intern_unlock();
+	kvs_mailbox = box;
+}
+
+void queue_event(const struct KVS_event *event){
+	if(kvs_events_first == kvs_events_len){
+		kvs_events_first = 0;
+		kvs_events_len = 0;
+	}
+	if(kvs_events_len == kvs_events_mem){
+		kvs_events_mem = 2 * kvs_events_mem + 1;
+		kvs_events = realloc(kvs_events, sizeof(struct KVS_event) * kvs_events_mem);
+	}
+	kvs_events[kvs_events_len++] = *event;
+}
+
+//Move the events from the mailbox of this process to its local queue, without 
+//locking. If events were lost an event with setnumber -1 is queued, the watched 
+//sets have to be read again then. Returns the number of queued events
+int KVS_Poll_events(){
+	if(kvs_mailbox == NULL)
+		return 0;
+	
+	int n = 0;
+	struct KVS_event event;
+	if(__atomic_exchange_n(&(kvs_mailbox->lost), 0, __ATOMIC_ACQ_REL)){
+		event = (struct KVS_event){-1, 0, KVS_DELTA_RESET, -1};
+		queue_event(&event);
+		n++;
+	}
+	while(mailbox_pop(kvs_mailbox, &event)){
+		queue_event(&event);
+		n++;
+	}
+	return n;
+}
+
+//Hand out the oldest queued event, returns false if there is none
+bool KVS_Next_event(struct KVS_event *event){
+	if(kvs_events_first == kvs_events_len)
+		return false;
+	*event = kvs_events[kvs_events_first++];
+	return true;
+}
+
+//Take over the watchers of the set, caller holds the lock of the set. Watchers with a 
+//mailbox get the change right away, the others an MPI notification once the lock is released
+void notify_watchers(int pos, int op, int rank){
+	int num_updates = entries_baseptr[pos].num_updates;
+	if(num_updates == 0)
+		return;
+	
+	struct KVS_event event = {pos, entries_baseptr[pos].version, op, rank};
+	size_t *mailboxes = (size_t *)(arena_baseptr + head_baseptr->mailboxes_off);
+	int *watchers = malloc(sizeof(int) * num_updates + 1);
+	int num_watchers = 0;
+	for(int i = 0; i < num_updates; i++){
+		int watcher = updates_of(pos)[i];
+		size_t box = 0;
+		if(watcher >= 0 && watcher < head_baseptr->mailboxes_size)
+			box = __atomic_load_n(&mailboxes[watcher], __ATOMIC_ACQUIRE);
+		if(box != 0){
+			mailbox_push((struct KVS_mailbox *)(arena_baseptr + box), &event);
+			kvs_stats.notifications++;
+		}
+		else
+			watchers[num_watchers++] = watcher;
+	}
+	entries_baseptr[pos].num_updates = 0;
+	
+	if(num_watchers == 0){
+		free(watchers);
+		return;
+	}
+	if(kvs_outbox_len == kvs_outbox_mem){
+		kvs_outbox_mem = 2 * kvs_outbox_mem + 1;
+		kvs_outbox = realloc(kvs_outbox, sizeof(struct KVS_outbox) * kvs_outbox_mem);
+	}
+	struct KVS_outbox *box = &kvs_outbox[kvs_outbox_len++];
+	box->setnumber = pos;
+	box->num_watchers = num_watchers;
+	box->watchers = watchers;
+}
+
+//Complete the notifications that were delivered meanwhile, never blocks
+void KVS_Progress_notifications(){
+	pthread_mutex_lock(&kvs_sends_lock);
+	int n = 0;
+	for(int i = 0; i < kvs_num_sends; i++){
+		int flag;
+		MPI_Test(&kvs_sends[i], &flag, MPI_STATUS_IGNORE);
+		if(flag){
+			free(kvs_send_buffers[i]);
+			continue;
+		}
+		kvs_sends[n] = kvs_sends[i];
+		kvs_send_buffers[n] = kvs_send_buffers[i];
+		n++;
+	}
+	kvs_num_sends = n;
+	pthread_mutex_unlock(&kvs_sends_lock);
+	
+	//Updates of other nodes are applied whenever their leader gets here
+	KVS_Progress_replicas();
+}
+
+//Send buffer without waiting, it is freed once the send completed
+void post_send(int *buffer, int count, int dest, int tag, MPI_Comm comm){
+	pthread_mutex_lock(&kvs_sends_lock);
+	if(kvs_num_sends == kvs_mem_sends){
+		kvs_mem_sends = 2 * kvs_mem_sends + 1;
+		kvs_sends = realloc(kvs_sends, sizeof(MPI_Request) * kvs_mem_sends);
+		kvs_send_buffers = realloc(kvs_send_buffers, sizeof(int*) * kvs_mem_sends);
+	}
+	kvs_send_buffers[kvs_num_sends] = buffer;
+	MPI_Isend(buffer, count, MPI_INT, dest, tag, comm, &kvs_sends[kvs_num_sends++]);
+	pthread_mutex_unlock(&kvs_sends_lock);
+}
+
+//A notification tells its receiver which ranks it has to pass it on to
+void post_notification(int setnumber, int rank, const int *forward, int num_forward){
+	int *msg = malloc(sizeof(int) * (num_forward + 1));
+	msg[0] = KVS_VERSION_UPDATE;
+	memcpy(msg + 1, forward, sizeof(int) * num_forward);
+	post_send(msg, num_forward + 1, rank, setnumber, MPI_COMM_WORLD);
+	kvs_stats.notifications++;
+}
+
+//Few watchers get a message each. Otherwise the list is split in halves, the first 
+//rank of the upper half gets the upper half to pass on and the lower half is split 
+//again, so the sender posts log2(n) messages and everybody is reached after log2(n) 
+//hops. Messages carry at most KVS_NOTIFY_MAX_RANKS ranks, longer lists are cut into 
+//subtrees of that size first
+void fan_out(int setnumber, const int *ranks, int n){
+	if(n <= KVS_NOTIFY_TREE){
+		for(int i = 0; i < n; i++)
+			post_notification(setnumber, ranks[i], NULL, 0);
+		return;
+	}
+	
+	while(n > 0){
+		int upper = n - n / 2;
+		if(upper > KVS_NOTIFY_MAX_RANKS + 1)
+			upper = KVS_NOTIFY_MAX_RANKS + 1;
+		n -= upper;
+		post_notification(setnumber, ranks[n], ranks + n + 1, upper - 1);
+	}
+}
+
+__thread bool kvs_receiving = false; //Set in the thread that applies the events of the KVS daemon
+
+//Send the notifications collected under the locks, caller must not hold a lock
+void flush_notifications(){
+	if(kvs_receiving)
+		return; //Makes no MPI calls, there are no MPI watchers with the daemon
+	KVS_Progress_notifications();
+	flush_replicas();
+	if(kvs_outbox_len == 0)
+		return;
+	
+	double start = kvs_clock();
+	for(int i = 0; i < kvs_outbox_len; i++){
+		fan_out(kvs_outbox[i].setnumber, kvs_outbox[i].watchers, kvs_outbox[i].num_watchers);
+		free(kvs_outbox[i].watchers);
+	}
+	kvs_outbox_len = 0;
+	kvs_stats.notify_time += kvs_clock() - start;
+}
+
+//Called by a watcher with the notification it received, passes it on to the 
+//ranks listed in it
+void KVS_Notification_received(int setnumber, const int *msg, MPI_Status *status){
+	int count;
+	MPI_Get_count(status, MPI_INT, &count);
+	KVS_Progress_notifications();
+	if(count > 1)
+		fan_out(setnumber, msg + 1, count - 1);
+}
+
+//Every node has a replica of the KVS. Writers send the new state of the set to the 
+//leaders of the other nodes, which apply it to their replica
+int kvs_node = 0, kvs_num_nodes = 1;
+int *kvs_leaders = NULL; //World rank of the leader of every node
+bool kvs_is_leader = false;
+MPI_Comm kvs_replica_comm = MPI_COMM_NULL;
+int *kvs_replica_sent = NULL; //Updates this process sent to every node
+int kvs_replica_received = 0; //Updates the leader applied
+pthread_mutex_t kvs_replica_lock = PTHREAD_MUTEX_INITIALIZER; //Updates are applied one at a time and in order, by any thread
+__thread bool kvs_applying = false; //Set while an update of another node is applied, it is not sent on
+
+void post_replica(const int *msg, int count){
+	for(int node = 0; node < kvs_num_nodes; node++){
+		if(node == kvs_node) continue;
+		int *copy = malloc(sizeof(int) * count);
+		memcpy(copy, msg, sizeof(int) * count);
+		post_send(copy, count, kvs_leaders[node], KVS_REPLICA_TAG, kvs_replica_comm);
+		kvs_replica_sent[node]++;
+	}
+}
+
+//Like notifications, changes for the other replicas are collected under the locks and 
+//sent by flush_notifications
+__thread int **kvs_replica_outbox = NULL;
+__thread int kvs_replica_outbox_len = 0, kvs_replica_outbox_mem = 0;
+
+void queue_replica(int *msg){
+	if(kvs_replica_outbox_len == kvs_replica_outbox_mem){
+		kvs_replica_outbox_mem = 2 * kvs_replica_outbox_mem + 4;
+		kvs_replica_outbox = realloc(kvs_replica_outbox, sizeof(int*) * kvs_replica_outbox_mem);
+	}
+	kvs_replica_outbox[kvs_replica_outbox_len++] = msg;
+}
+
+void flush_replicas(){
+	for(int i = 0; i < kvs_replica_outbox_len; i++){
+		struct KVS_replica_msg *msg = (struct KVS_replica_msg *)kvs_replica_outbox[i];
+		post_replica(kvs_replica_outbox[i], KVS_REPLICA_HEADER + msg->num_ranks);
+		free(kvs_replica_outbox[i]);
+	}
+	kvs_replica_outbox_len = 0;
+}
+
+//Queue the change of the set for the other replicas along with the whole set after it, 
+//caller holds a lock of the set
+void replicate_change(int pos, int op, int rank){
+	if(kvs_num_nodes == 1 || kvs_applying)
+		return;
+	
+	struct KVS_view view;
+	entry_view(pos, &view);
+	int *buf = calloc(KVS_REPLICA_HEADER + view.num_ranks, sizeof(int));
+	struct KVS_replica_msg *msg = (struct KVS_replica_msg *)buf;
+	msg->op = op;
+	msg->version = entries_baseptr[pos].version;
+	msg->origin = entries_baseptr[pos].origin;
+	msg->rank = rank;
+	msg->created_node = entries_baseptr[pos].created_node;
+	msg->created_id = entries_baseptr[pos].created_id;
+	memcpy(msg->key, entries_baseptr[pos].key, KVS_MAX_SET_NAME_LENGTH);
+	msg->num_ranks = KVS_view_expand(&view, buf + KVS_REPLICA_HEADER);
+	queue_replica(buf);
+}
+
+void replicate_destroy(const char *key, int created_node, int created_id){
+	if(kvs_num_nodes == 1 || kvs_applying)
+		return;
+	
+	int *buf = calloc(KVS_REPLICA_HEADER, sizeof(int));
+	struct KVS_replica_msg *msg = (struct KVS_replica_msg *)buf;
+	msg->op = KVS_DELTA_DESTROY;
+	msg->origin = kvs_node;
+	msg->rank = -1;
+	msg->created_node = created_node;
+	msg->created_id = created_id;
+	strcpy(msg->key, key);
+	queue_replica(buf);
+}
+
+//Remember a destroyed set, caller holds the global lock
+void add_tombstone(const char *key, int created_node, int created_id){
+	struct KVS_tombstone *t = &(head_baseptr->tombstones[head_baseptr->num_tombstones++ % KVS_TOMBSTONES]);
+	strcpy(t->key, key);
+	t->created_node = created_node;
+	t->created_id = created_id;
+}
+
+bool is_tombstone(const char *key, int created_node, int created_id){
+	KVS_intern_lock();
+	int n = head_baseptr->num_tombstones < KVS_TOMBSTONES ? head_baseptr->num_tombstones : KVS_TOMBSTONES;
+	bool found = false;
+	for(int i = 0; i < n && !found; i++){
+		struct KVS_tombstone *t = &(head_baseptr->tombstones[i]);
+		found = t->created_node == created_node && t->created_id == created_id && strcmp(t->key, key) == 0;
+	}
+	KVS_intern_unlock();
+	return found;
+}
+
+uint64_t *index_row(int rank){
+	return (uint64_t *)(arena_baseptr + head_baseptr->index_off) + (size_t)rank * head_baseptr->index_words;
+}
+
+//Mark the rank as member of the set or not, caller holds the lock of the set. 
+//Bits of other sets in the same word may change at the same time
+void index_update(int setnumber, int rank, bool member){
+	if(rank < 0 || rank >= head_baseptr->index_ranks)
+		return;
+	uint64_t *word = index_row(rank) + setnumber / 64;
+	uint64_t bit = (uint64_t)1 << (setnumber % 64);
+	if(member)
+		__atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+	else
+		__atomic_fetch_and(word, ~bit, __ATOMIC_RELEASE);
+}
+
+//Set the bits of the new members first and clear those of the old members that are 
+//not in the set anymore, so ranks that stay are never missing from the index
+void index_replace(int setnumber, int num_old, const int *old, int num_new, const int *new){
+	bool *stays = calloc(head_baseptr->index_ranks + 1, sizeof(bool));
+	for(int i = 0; i < num_new; i++){
+		index_update(setnumber, new[i], true);
+		if(new[i] >= 0 && new[i] < head_baseptr->index_ranks)
+			stays[new[i]] = true;
+	}
+	for(int i = 0; i < num_old; i++)
+		if(old[i] >= 0 && old[i] < head_baseptr->index_ranks && !stays[old[i]])
+			index_update(setnumber, old[i], false);
+	free(stays);
+}
+
+int max_rank(int num_ranks, const int *ranks){
+	int max = -1;
+	for(int i = 0; i < num_ranks; i++)
+		if(ranks[i] > max) max = ranks[i];
+	return max;
+}
+
+//Move the index to a block for at least num_ranks ranks and num_words words per rank. 
+//Caller holds the global lock and all stripes, lock-free readers retry if they 
+//see index_seq change
+void grow_index(int num_ranks, int num_words){
+	int old_ranks = head_baseptr->index_ranks, old_words = head_baseptr->index_words;
+	if(num_ranks <= old_ranks && num_words <= old_words)
+		return;
+	if(num_ranks < old_ranks) num_ranks = old_ranks;
+	if(num_words < old_words) num_words = old_words;
+	
+	size_t size = sizeof(uint64_t) * num_ranks * num_words;
+	size_t offset = arena_alloc(size);
+	uint64_t *index = (uint64_t *)(arena_baseptr + offset);
+	memset(index, 0, size);
+	for(int r = 0; r < old_ranks; r++)
+		memcpy(index + (size_t)r * num_words, index_row(r), sizeof(uint64_t) * old_words);
+	
+	__atomic_store_n(&(head_baseptr->index_seq), head_baseptr->index_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	arena_free(head_baseptr->index_off, sizeof(uint64_t) * old_ranks * old_words);
+	head_baseptr->index_off = offset;
+	head_baseptr->index_ranks = num_ranks;
+	head_baseptr->index_words = num_words;
+	__atomic_store_n(&(head_baseptr->index_seq), head_baseptr->index_seq + 1, __ATOMIC_RELEASE);
+}
+
+//Make room for the rank in the index before taking the lock of a set
+void ensure_index_rank(int rank){
+	if(rank < __atomic_load_n(&(head_baseptr->index_ranks), __ATOMIC_ACQUIRE))
+		return;
+	
+	KVS_intern_lock();
+	for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+		sem_wait(&(head_baseptr->stripes[i]));
+	int num_ranks = 2 * head_baseptr->index_ranks;
+	if(num_ranks <= rank) num_ranks = rank + 1;
+	if(rank >= head_baseptr->index_ranks)
+		grow_index(num_ranks, head_baseptr->index_words);
+	for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+		sem_post(&(head_baseptr->stripes[i]));
+	KVS_intern_unlock();
+}
+
+//Setnumbers of the sets that contain the rank, read without locking from the reverse 
+//index in O(number of sets / 64). Returns their number, the user must free setnumbers
+int KVS_Get_sets_of_rank(int rank, int **setnumbers){
+	uint64_t *row = NULL;
+	int num_words;
+	unsigned int seq;
+	do{
+		while((seq = __atomic_load_n(&(head_baseptr->index_seq), __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		num_words = head_baseptr->index_words;
+		size_t offset = head_baseptr->index_off + sizeof(uint64_t) * (size_t)rank * num_words;
+		if(rank < 0 || rank >= head_baseptr->index_ranks || !arena_contains(offset, sizeof(uint64_t) * num_words))
+			num_words = 0;
+		row = realloc(row, sizeof(uint64_t) * num_words + 1);
+		memcpy(row, arena_baseptr + offset, sizeof(uint64_t) * num_words);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}while(__atomic_load_n(&(head_baseptr->index_seq), __ATOMIC_RELAXED) != seq);
+	
+	int n = 0;
+	for(int w = 0; w < num_words; w++)
+		n += __builtin_popcountll(row[w]);
+	*setnumbers = malloc(sizeof(int) * n + 1);
+	n = 0;
+	for(int w = 0; w < num_words; w++)
+		for(uint64_t bits = row[w]; bits != 0; bits &= bits - 1)
+			(*setnumbers)[n++] = 64 * w + __builtin_ctzll(bits);
+	free(row);
+	return n;
+}
+
+//Caller holds the global lock. Beyond KVS_RETIRED_MAX the block is never freed
+void retire_table(size_t offset, size_t size, unsigned int generation){
+	if(head_baseptr->num_retired == KVS_RETIRED_MAX)
+		return;
+	head_baseptr->retired[head_baseptr->num_retired++] = (struct KVS_retired){offset, size, generation};
+}
+
+//Free the replaced tables no thread can be reading anymore, caller holds the global lock. 
+//Generations are compared by their difference, so they may wrap
+void reclaim_tables(){
+	int num_readers = __atomic_load_n(&(head_baseptr->num_readers), __ATOMIC_SEQ_CST);
+	if(num_readers > KVS_READER_SLOTS)
+		return; //Some thread cannot announce its tables
+	
+	int n = 0;
+	for(int i = 0; i < head_baseptr->num_retired; i++){
+		struct KVS_retired retired = head_baseptr->retired[i];
+		bool used = false;
+		for(int j = 0; j < num_readers && !used; j++){
+			unsigned int gen = __atomic_load_n(&(head_baseptr->readers[j]), __ATOMIC_SEQ_CST);
+			used = gen != UINT_MAX && (int)(gen - retired.generation) < 0;
+		}
+		if(used)
+			head_baseptr->retired[n++] = retired;
+		else
+			arena_free(retired.offset, retired.size);
+	}
+	head_baseptr->num_retired = n;
+}
+
+//Move the entries and the probe table to bigger blocks, caller holds the global lock. 
+//All stripes are taken to keep writers out, lock-free readers go on with the old 
+//tables until they notice the new generation. Those stay allocated until no thread reads them
+void grow_tables(int table_size, int probe_size){
+	for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+		sem_wait(&(head_baseptr->stripes[i]));
+	
+	size_t old_entries_off = head_baseptr->entries_off, old_probe_off = head_baseptr->probe_off;
+	size_t old_entries_size = sizeof(struct KVS_entry) * head_baseptr->table_size;
+	size_t old_probe_size = sizeof(int) * head_baseptr->probe_size;
+	size_t entries_off = head_baseptr->entries_off;
+	if(table_size > head_baseptr->table_size){
+		entries_off = arena_alloc(sizeof(struct KVS_entry) * table_size);
+		memcpy(arena_baseptr + entries_off, entries_baseptr, sizeof(struct KVS_entry) * head_baseptr->table_size);
+		memset(arena_baseptr + entries_off + sizeof(struct KVS_entry) * head_baseptr->table_size, 0, 
+			sizeof(struct KVS_entry) * (table_size - head_baseptr->table_size));
+	}
+	
+	size_t probe_off = head_baseptr->probe_off;
+	int probe_used = head_baseptr->probe_used;
+	if(probe_size > head_baseptr->probe_size){
+		probe_off = arena_alloc(sizeof(int) * probe_size);
+		int *probe = (int *)(arena_baseptr + probe_off);
+		for(int i = 0; i < probe_size; i++)
+			probe[i] = KVS_PROBE_EMPTY;
+		
+		//Rehash, deleted slots are dropped
+		probe_used = 0;
+		for(int i = 0; i < head_baseptr->probe_size; i++){
+			int id = probe_baseptr[i];
+			if(id < 0) continue;
+			int n = hash_seeded(entries_baseptr[id].key, KVS_PROBE_SEED) & (probe_size - 1);
+			while(probe[n] != KVS_PROBE_EMPTY)
+				n = (n + 1) & (probe_size - 1);
+			probe[n] = id;
+			probe_used++;
+		}
+	}
+	grow_index(head_baseptr->index_ranks, (table_size + 63) / 64);
+	
+	//Publish the new tables
+	__atomic_store_n(&(head_baseptr->generation), head_baseptr->generation + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	head_baseptr->entries_off = entries_off;
+	head_baseptr->table_size = table_size;
+	head_baseptr->probe_off = probe_off;
+	head_baseptr->probe_size = probe_size;
+	head_baseptr->probe_used = probe_used;
+	__atomic_store_n(&(head_baseptr->generation), head_baseptr->generation + 1, __ATOMIC_SEQ_CST);
+	arena_refresh();
+	
+	if(entries_off != old_entries_off)
+		retire_table(old_entries_off, old_entries_size, kvs_generation);
+	if(probe_off != old_probe_off)
+		retire_table(old_probe_off, old_probe_size, kvs_generation);
+	reclaim_tables();
+	
+	for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+		sem_post(&(head_baseptr->stripes[i]));
+}
+
+//Create a new process set at runtime with the given version, returns its setnumber, 
+//-1 if the name is taken or too long and -2 if the window of the arena is full. The 
+//table grows if needed. created_id -1 makes it the next creation of this node
+int create_set(char *key, int num_ranks, int *ranks, int version, int origin, int created_node, int created_id){
+	if(strlen(key) == 0 || strlen(key) >= KVS_MAX_SET_NAME_LENGTH || strcmp(key, "mpi://SELF") == 0)
+		return -1;
+	
+	//Blocks are rounded up to powers of two, and the tables and the index may double
+	int index_ranks = max_rank(num_ranks, ranks) + 1;
+	if(index_ranks < head_baseptr->index_ranks)
+		index_ranks = head_baseptr->index_ranks;
+	size_t size = sizeof(struct KVS_entry) * 2 * head_baseptr->table_size + sizeof(int) * 2 * head_baseptr->probe_size + 
+		sizeof(uint64_t) * 2 * index_ranks * (head_baseptr->index_words + 1) + 
+		sizeof(int) * (KVS_MIN_BLOCK + 2 * num_ranks) + KVS_LOG_SIZE * sizeof(struct KVS_delta) + sizeof(struct KVS_watch);
+	if(!window_has_room(2 * size))
+		return -2;
+	
+	KVS_intern_lock();
+	
+	if(locate_set_quiet(key) >= 0){
+		KVS_intern_unlock();
+		return -1;
+	}
+	
+	int table_size = head_baseptr->table_size;
+	int probe_size = head_baseptr->probe_size;
+	if(head_baseptr->num_entries == table_size)
+		table_size *= 2;
+	if(2 * (head_baseptr->probe_used + 1) > probe_size)
+		probe_size *= 2;
+	if(table_size != head_baseptr->table_size || probe_size != head_baseptr->probe_size)
+		grow_tables(table_size, probe_size);
+	int max = max_rank(num_ranks, ranks);
+	if(max >= head_baseptr->index_ranks){
+		for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+			sem_wait(&(head_baseptr->stripes[i]));
+		grow_index(max + 1 > 2 * head_baseptr->index_ranks ? max + 1 : 2 * head_baseptr->index_ranks, head_baseptr->index_words);
+		for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+			sem_post(&(head_baseptr->stripes[i]));
+	}
+	
+	//Nobody can find the entry before it is in the probe table
+	int pos = head_baseptr->num_entries;
+	entries_baseptr[pos].updates_off = arena_alloc(KVS_MIN_BLOCK * sizeof(int));
+	entries_baseptr[pos].log_off = arena_alloc(KVS_LOG_SIZE * sizeof(struct KVS_delta));
+	entries_baseptr[pos].watch_off = arena_alloc(sizeof(struct KVS_watch));
+	entries_baseptr[pos].mem_updates = KVS_MIN_BLOCK;
+	insert_entry(pos, key, num_ranks, ranks, version);
+	entries_baseptr[pos].origin = origin;
+	entries_baseptr[pos].created_node = created_node;
+	entries_baseptr[pos].created_id = created_id < 0 ? head_baseptr->creations++ : created_id;
+	index_replace(pos, 0, NULL, num_ranks, ranks);
+	
+	probe_table_insert(key, pos);
+	__atomic_store_n(&(head_baseptr->num_entries), pos + 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&(head_baseptr->num_sets), 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELEASE); //Caches that missed the entry notice it
+	replicate_change(pos, KVS_DELTA_RESET, -1);
+	
+	KVS_intern_unlock();
+	flush_notifications();
+	return pos;
+}
+
+int local_create(char *key, int num_ranks, int *ranks){
+	return create_set(key, num_ranks, ranks, 1, kvs_node, kvs_node, -1);
+}
+
+//Delete a process set, its watchers are notified. Returns -1 if it does not exist
+int local_destroy(char *key){
+	if(strcmp(key, "mpi://WORLD") == 0)
+		return -1;
+	
+	KVS_intern_lock();
+	
+	int pos;
+	if(0 > (pos = locate_set_quiet(key))){
+		KVS_intern_unlock();
+		return -1;
+	}
+	
+	KVS_intern_lock_set(key);
+	
+	struct KVS_view view;
+	entry_view(pos, &view);
+	int *ranks = malloc(sizeof(int) * view.num_ranks + 1);
+	int num_ranks = KVS_view_expand(&view, ranks);
+	index_replace(pos, num_ranks, ranks, 0, NULL);
+	free(ranks);
+	
+	//Changes of this creation that are still on their way from other nodes are dropped
+	int created_node = entries_baseptr[pos].created_node, created_id = entries_baseptr[pos].created_id;
+	add_tombstone(key, created_node, created_id);
+	
+	write_seq_begin(pos);
+	size_t ranks_off = entries_baseptr[pos].ranks_off;
+	size_t log_off = entries_baseptr[pos].log_off;
+	entries_baseptr[pos].deleted = 1;
+	entries_baseptr[pos].key[0] = 0;
+	entries_baseptr[pos].key_length = 0;
+	entries_baseptr[pos].version++;
+	entries_baseptr[pos].num_ranks = 0;
+	entries_baseptr[pos].base_num_ranks = 0;
+	entries_baseptr[pos].rep_len = 0;
+	entries_baseptr[pos].num_pending = 0;
+	entries_baseptr[pos].ranks_off = 0;
+	entries_baseptr[pos].log_off = 0;
+	int num_history = entries_baseptr[pos].num_history;
+	entries_baseptr[pos].num_history = 0;
+	write_seq_end(pos);
+	publish_version(pos); //The version word stays, watchers may still sleep on it
+	
+	probe_table_remove(pos);
+	__atomic_fetch_sub(&(head_baseptr->num_sets), 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELEASE);
+	
+	notify_watchers(pos, KVS_DELTA_DESTROY, -1);
+	publish_change();
+	arena_free(ranks_off, entries_baseptr[pos].mem_ranks * sizeof(int));
+	arena_free(entries_baseptr[pos].updates_off, entries_baseptr[pos].mem_updates * sizeof(int));
+	arena_free(log_off, KVS_LOG_SIZE * sizeof(struct KVS_delta));
+	for(int i = 0; i < num_history; i++)
+		free_snapshot(&entries_baseptr[pos].history[i]);
+	for(int i = 0; i < KVS_PINS; i++)
+		free_snapshot(&entries_baseptr[pos].pinned[i]);
+	entries_baseptr[pos].updates_off = 0;
+	entries_baseptr[pos].mem_ranks = 0;
+	entries_baseptr[pos].mem_updates = 0;
+	replicate_destroy(key, created_node, created_id);
+	
+	KVS_intern_unlock_set(key);
+	KVS_intern_unlock();
+	flush_notifications();
+	return 0;
+}
+
+//Replace the ranks of the set and publish the version, caller holds the lock of the set 
+//and made room for the ranks in the index
+void put_entry(int pos, int num_ranks, int *ranks, int version, int origin){
+	struct KVS_view view;
+	entry_view(pos, &view);
+	int *old_ranks = malloc(sizeof(int) * view.num_ranks + 1);
+	int num_old = KVS_view_expand(&view, old_ranks);
+	index_replace(pos, num_old, old_ranks, num_ranks, ranks);
+	free(old_ranks);
+	
+	write_seq_begin(pos);
+	
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELAXED);
+	entries_baseptr[pos].version = version;
+	entries_baseptr[pos].origin = origin;
+	store_ranks(pos, num_ranks, ranks);
+	entries_baseptr[pos].num_pending = 0;
+	log_append(pos, KVS_DELTA_RESET, -1);
+	
+	write_seq_end(pos);
+	publish_version(pos);
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELEASE);
+	
+	notify_watchers(pos, KVS_DELTA_RESET, -1);
+	publish_change();
+}
+
+//lock = false means the caller already holds the lock of the set
+//Without the lock, the caller made room for the ranks in the index. 
+//Returns -1 if the set does not exist (anymore)
+int KVS_Put_internal(char *key, int num_ranks, int *ranks, bool lock){
+	
+	if(lock){
+		ensure_index_rank(max_rank(num_ranks, ranks));
+		KVS_intern_lock_set(key);
+	}
+	
+	int pos = locate_set_quiet(key);
+	if(pos >= 0){
+		put_entry(pos, num_ranks, ranks, entries_baseptr[pos].version + 1, kvs_node);
+		replicate_change(pos, KVS_DELTA_RESET, -1);
+	}
+	
+	if(lock){
+		KVS_intern_unlock_set(key);
+		flush_notifications();
+	}
+	return pos >= 0 ? 0 : -1;
+}
+
+int local_put(char *key, int num_ranks, int *ranks){
+	//The new ranks block and the index, the old block moves to the history
+	size_t size = sizeof(int) * 2 * (num_ranks + 2) + sizeof(uint64_t) * 2 * (max_rank(num_ranks, ranks) + 1) * head_baseptr->index_words;
+	if(!window_has_room(2 * size))
+		window_full();
+	return KVS_Put_internal(key, num_ranks, ranks, true);
+}
+
+int kvs_self_rank; //Backing storage for views of mpi://SELF
+
+//A view read without the lock may be torn, make sure using it stays inside the arena
+bool view_sane(const struct KVS_view *view){
+	return view->num_ranks >= 0 && view->len >= 0 && view->log_first >= 0 && 
+		view->num_deltas >= 0 && view->num_deltas <= KVS_LOG_SIZE && 
+		view->base_num_ranks >= 0 && view->base_num_ranks <= view->num_ranks + view->num_deltas && 
+		arena_contains((const char *)view->data - arena_baseptr, view->len * sizeof(int)) && 
+		arena_contains((const char *)view->log - arena_baseptr, KVS_LOG_SIZE * sizeof(struct KVS_delta));
+}
+
+void snapshot_view(const struct KVS_snapshot *snapshot, struct KVS_view *view){
+	view->data = (const int *)(arena_baseptr + snapshot->offset);
+	view->rep = snapshot->rep;
+	view->len = snapshot->rep_len;
+	view->base_num_ranks = snapshot->num_ranks;
+	view->num_ranks = snapshot->num_ranks;
+	view->num_deltas = 0;
+}
+
+//Describe an older version of the set, either by a pinned copy or by the newest ranks 
+//block that is not newer plus the deltas that followed it. Returns false if the version 
+//is not kept anymore, the caller makes sure the entry is consistent
+bool version_view(int pos, int version, struct KVS_view *view){
+	struct KVS_entry *entry = &entries_baseptr[pos];
+	entry_view(pos, view);
+	if(entry->deleted || version < 1 || version > entry->version)
+		return false;
+	if(version == entry->version)
+		return true;
+	view->version = version;
+	
+	for(int i = 0; i < KVS_PINS; i++){
+		if(entry->pinned[i].pins > 0 && entry->pinned[i].version == version){
+			snapshot_view(&entry->pinned[i], view);
+			return true;
+		}
+	}
+	
+	int base_version = entry->base_version;
+	for(int i = 0; base_version > version; i++){
+		if(i == entry->num_history)
+			return false;
+		snapshot_view(&entry->history[i], view);
+		base_version = entry->history[i].version;
+	}
+	
+	//The deltas of the versions after the block have to be in the log still
+	int back = entry->version - base_version;
+	view->num_deltas = version - base_version;
+	view->log_first = entry->log_count - back;
+	if(view->num_deltas > 0 && (back > KVS_LOG_SIZE || view->log_first < 0))
+		return false;
+	view->num_ranks = view->base_num_ranks;
+	for(int i = 0; i < view->num_deltas; i++){
+		const struct KVS_delta *d = view_delta(view, i);
+		if(d->op == KVS_DELTA_RESET)
+			return false;
+		view->num_ranks += d->op == KVS_DELTA_ADD ? 1 : -1;
+	}
+	return true;
+}
+
+//Like KVS_Get_view, but for the given version of the set. Older versions are available 
+//while they are pinned, or as long as the history and the delta log of the set reach 
+//back to them. Returns false otherwise, the view must not be used then
+bool KVS_Get_view_version(char *key, int version, struct KVS_view *view){
+	if(strcmp(key, "mpi://SELF") == 0){
+		KVS_Get_view(key, view);
+		return version == view->version;
+	}
+	
+	int pos;
+	if(0 > (pos = lookup_set(key)))
+		return false;
+	view->generation = kvs_generation;
+	
+	for(;;){
+		view->seq = read_seq_begin(pos);
+		if(version_view(pos, version, view) && view_sane(view))
+			return true;
+		if(!read_seq_retry(pos, view->seq))
+			return false;
+	}
+}
+
+//Keep a copy of a version of the set until it is unpinned, so groups for it can be 
+//created while the set changes. Pins of the same version are counted. 
+//Returns 0 on success, -1 if the set does not exist, -2 if the version is not 
+//available anymore and -3 if too many versions of the set are pinned
+int KVS_Pin_version(char *key, int version){
+	KVS_intern_lock_set(key);
+	
+	int pos, ret = 0;
+	if(0 > (pos = locate_set_quiet(key))){
+		KVS_intern_unlock_set(key);
+		return -1;
+	}
+	
+	struct KVS_snapshot *pinned = entries_baseptr[pos].pinned;
+	int free_slot = -1;
+	for(int i = 0; i < KVS_PINS; i++){
+		if(pinned[i].pins > 0 && pinned[i].version == version){
+			pinned[i].pins++;
+			KVS_intern_unlock_set(key);
+			return 0;
+		}
+		if(pinned[i].pins == 0 && free_slot < 0)
+			free_slot = i;
+	}
+	
+	struct KVS_view view;
+	if(free_slot < 0)
+		ret = -3;
+	else if(!version_view(pos, version, &view))
+		ret = -2;
+	else{
+		int *ranks = malloc(sizeof(int) * view.num_ranks + 1);
+		int num_ranks = KVS_view_expand(&view, ranks);
+		
+		struct KVS_snapshot copy;
+		store_snapshot(&copy, version, num_ranks, ranks);
+		copy.pins = 1;
+		write_seq_begin(pos);
+		pinned[free_slot] = copy;
+		write_seq_end(pos);
+		free(ranks);
+	}
+	
+	KVS_intern_unlock_set(key);
+	return ret;
+}
+
+//Returns -1 if the version of the set is not pinned
+int KVS_Unpin_version(char *key, int version){
+	KVS_intern_lock_set(key);
+	
+	int pos, ret = -1;
+	if(0 <= (pos = locate_set_quiet(key))){
+		struct KVS_snapshot *pinned = entries_baseptr[pos].pinned;
+		for(int i = 0; i < KVS_PINS; i++){
+			if(pinned[i].pins > 0 && pinned[i].version == version){
+				if(pinned[i].pins == 1){
+					write_seq_begin(pos);
+					free_snapshot(&pinned[i]);
+					write_seq_end(pos);
+				}
+				else
+					pinned[i].pins--;
+				ret = 0;
+				break;
+			}
+		}
+	}
+	
+	KVS_intern_unlock_set(key);
+	return ret;
+}
+
+//View of no set, version and setnumber are -1 and KVS_Release_view accepts it
+void empty_view(struct KVS_view *view){
+	view->data = NULL;
+	view->rep = KVS_REP_LIST;
+	view->len = 0;
+	view->num_ranks = 0;
+	view->base_num_ranks = 0;
+	view->num_deltas = 0;
+	view->log_first = 0;
+	view->log = NULL;
+	view->version = -1;
+	view->setnumber = -1;
+	view->seq = 0;
+}
+
+//Borrow the entry of a set directly from the shared memory without locking or copying. 
+//The view is only consistent if KVS_Release_view returns true, the caller has to 
+//retry otherwise. Do not modify the set from this process while holding the view. 
+//Returns false if there is no such set, e.g. it was destroyed, the view is empty then
+bool KVS_Get_view(char *key, struct KVS_view *view){
+	if(strcmp(key, "mpi://SELF") == 0){
+		kvs_self_rank = mpi_world_rank;
+		view->data = &kvs_self_rank;
+		view->rep = KVS_REP_LIST;
+		view->len = 1;
+		view->num_ranks = 1;
+		view->base_num_ranks = 1;
+		view->num_deltas = 0;
+		view->log_first = 0;
+		view->log = NULL;
+		view->version = 1;
+		view->setnumber = -1;
+		view->seq = 0;
+		return true;
+	}
+	
+	int pos;
+	if(0 > (pos = lookup_set(key))){
+		empty_view(view);
+		return false;
+	}
+	view->generation = kvs_generation;
+	
+	for(;;){
+		view->seq = read_seq_begin(pos);
+		
+		entry_view(pos, view);
+		if(view_sane(view))
+			return true;
+		
+		//Torn read of the size
+		if(!read_seq_retry(pos, view->seq)) {
+			printf("KVS %i: Get_view, inconsistent entry %i\n", mpi_world_rank, pos);
+			exit(-1);
+		}
+	}
+}
+
+//Returns false if a writer changed the set or the table moved while the view was held
+bool KVS_Release_view(struct KVS_view *view){
+	if(view->setnumber < 0)
+		return true;
+	return !read_seq_retry(view->setnumber, view->seq) && 
+		__atomic_load_n(&(head_baseptr->generation), __ATOMIC_ACQUIRE) == view->generation;
+}
+
+//Decode the ranks of a view into ranks, which needs space for view->num_ranks ints. 
+//Ranks of the block keep their place unless they were deleted, added ones follow
+int KVS_view_expand(const struct KVS_view *view, int *ranks){
+	if(view->num_deltas == 0)
+		return expand_ranks(view->rep, view->data, view->len, view->num_ranks, ranks);
+	
+	int first, last, n = 0;
+	int *base = malloc(sizeof(int) * view->base_num_ranks + 1);
+	int num_base = expand_ranks(view->rep, view->data, view->len, view->base_num_ranks, base);
+	for(int i = 0; i < num_base && n < view->num_ranks; i++){
+		if(pending_ops(view, base[i], &first, &last) < 0 || last == KVS_DELTA_ADD)
+			ranks[n++] = base[i];
+	}
+	free(base);
+	
+	for(int i = 0; i < view->num_deltas && n < view->num_ranks; i++){
+		const struct KVS_delta *d = view_delta(view, i);
+		if(pending_ops(view, d->rank, &first, &last) == i && first == KVS_DELTA_ADD && last == KVS_DELTA_ADD)
+			ranks[n++] = d->rank;
+	}
+	return n;
+}
+
+bool KVS_view_contains(const struct KVS_view *view, int rank){
+	int first, last;
+	if(pending_ops(view, rank, &first, &last) >= 0)
+		return last == KVS_DELTA_ADD;
+	return encoded_contains(view->rep, view->data, view->len, rank);
+}
+
+//Copy an entry without taking the lock, retries if a writer interfered. 
+//Returns false if there is no such set
+bool KVS_Get_lockfree(char *key, int *num_ranks, int **ranks, int *version, int *setnumber){
+	struct KVS_view view;
+	int capacity = 0;
+	bool found;
+	*ranks = NULL;
+	
+	do{
+		found = KVS_Get_view(key, &view);
+		if(view.num_ranks > capacity || *ranks == NULL){
+			free(*ranks);
+			capacity = view.num_ranks;
+			*ranks = (int*)malloc(capacity * sizeof(int) + 1);
+		}
+		KVS_view_expand(&view, *ranks);
+	}while(!KVS_Release_view(&view));
+	
+	*num_ranks = view.num_ranks;
+	*version = view.version;
+	*setnumber = view.setnumber;
+	return found;
+}
+
+//fetches the value of a process set from KVS (user must free memory at ranks)
+//lock = false means the caller already holds the lock of the set (writer path), 
+//otherwise the entry is read lock-free. Returns false if there is no such set, 
+//there are no ranks and version and setnumber are -1 then
+bool KVS_Get_internal(char *key, int *num_ranks, int **ranks, int *version, int *setnumber, bool lock){
+	if(lock)
+		return KVS_Get_lockfree(key, num_ranks, ranks, version, setnumber);
+	
+	//For mpi://SELF
+	if(strcmp(key, "mpi://SELF") == 0){
+		*num_ranks = 1;
+		*version = 1;
+		*ranks = (int*)malloc(*num_ranks * sizeof(int) + 1);
+		*ranks[0] = mpi_world_rank;
+		*setnumber = -1; //TODO: Should this even have a setnumber?
+
+		return true;
+	}
+	
+	struct KVS_view view;
+	int pos = locate_set_quiet(key);
+	if(pos >= 0)
+		entry_view(pos, &view);
+	else
+		empty_view(&view);
+	*setnumber = view.setnumber;
+	*num_ranks = view.num_ranks;
+	*version = view.version;
+	*ranks = (int*)malloc(*num_ranks * sizeof(int) + 1);
+	KVS_view_expand(&view, *ranks);
+	return pos >= 0;
+}
+
+bool KVS_Get(char *key, int *num_ranks, int **ranks, int *version, int *setnumber){
+	return KVS_Get_internal(key, num_ranks, ranks, version, setnumber, true);
+}
+
+//Add or delete a single rank by appending a delta to the log of the set, the 
+//ranks block is only rewritten every KVS_LOG_COMPACT changes. 
+//Adding a member or deleting a non-member changes nothing. origin is the node that 
+//made the change. Returns -1 if the set does not exist
+int change_entry(char *key, int op, int rank, int origin){
+	if(op == KVS_DELTA_ADD)
+		ensure_index_rank(rank);
+	KVS_intern_lock_set(key);
+	
+	int pos;
+	if(0 > (pos = locate_set_quiet(key))){
+		KVS_intern_unlock_set(key);
+		return -1;
+	}
+	
+	struct KVS_view view;
+	entry_view(pos, &view);
+	if(KVS_view_contains(&view, rank) == (op == KVS_DELTA_ADD)){
+		KVS_intern_unlock_set(key);
+		return 0;
+	}
+	
+	write_seq_begin(pos);
+	
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELAXED);
+	entries_baseptr[pos].version++;
+	entries_baseptr[pos].origin = origin;
+	entries_baseptr[pos].num_ranks += op == KVS_DELTA_ADD ? 1 : -1;
+	log_append(pos, op, rank);
+	index_update(pos, rank, op == KVS_DELTA_ADD);
+	if(++entries_baseptr[pos].num_pending >= KVS_LOG_COMPACT)
+		compact_log(pos);
+	
+	write_seq_end(pos);
+	publish_version(pos);
+	__atomic_fetch_add(&(head_baseptr->version), 1, __ATOMIC_RELEASE);
+	
+	notify_watchers(pos, op, rank);
+	publish_change();
+	replicate_change(pos, op, rank);
+	
+	KVS_intern_unlock_set(key);
+	flush_notifications();
+	return 0;
+}
+
+//Returns -1 if the set does not exist (anymore)
+int change_membership(char *key, int op, int rank){
+	//Compacting the log writes a new ranks block, the index may grow for a new rank
+	int index_ranks = rank + 1 > head_baseptr->index_ranks ? rank + 1 : head_baseptr->index_ranks;
+	if(!window_has_room(sizeof(int) * 4 * (index_ranks + KVS_LOG_COMPACT) + sizeof(uint64_t) * 2 * index_ranks * head_baseptr->index_words))
+		window_full();
+	return change_entry(key, op, rank, kvs_node);
+}
+
+//Apply the change of another node to this replica. Single changes of a rank are applied 
+//as such, so changes of different ranks on different nodes all survive. A Put wins if 
+//it is newer, on the same version the higher node. Changes of destroyed sets are 
+//dropped, of two sets created with the same name on different nodes the one of the 
+//higher node survives
+void apply_replica(int *buf){
+	struct KVS_replica_msg *msg = (struct KVS_replica_msg *)buf;
+	int *ranks = buf + KVS_REPLICA_HEADER;
+	char *key = msg->key;
+	key[KVS_MAX_SET_NAME_LENGTH-1] = 0;
+	
+	kvs_applying = true;
+	if(is_tombstone(key, msg->created_node, msg->created_id)){
+		kvs_applying = false;
+		return;
+	}
+	
+	int pos = locate_set_quiet(key);
+	if(pos >= 0 && (entries_baseptr[pos].created_node != msg->created_node || 
+			entries_baseptr[pos].created_id != msg->created_id)){
+		if(entries_baseptr[pos].created_node > msg->created_node || 
+				(entries_baseptr[pos].created_node == msg->created_node && 
+				entries_baseptr[pos].created_id > msg->created_id)){
+			kvs_applying = false;
+			return;
+		}
+		local_destroy(key);
+		pos = -1;
+	}
+	
+	if(msg->op == KVS_DELTA_DESTROY){
+		if(pos >= 0)
+			local_destroy(key);
+		else{
+			KVS_intern_lock();
+			add_tombstone(key, msg->created_node, msg->created_id);
+			KVS_intern_unlock();
+		}
 	}
-	size_t size = sizeof(struct KVS_head);
-	ftruncate(fd, size);
-	if((head_baseptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == ((void *) -1)){
-		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
-		perror("mmap encountered: ");
-		exit(-1);
+	else if(pos < 0)
+		create_set(key, msg->num_ranks, ranks, msg->version, msg->origin, msg->created_node, msg->created_id);
+	else if(msg->op == KVS_DELTA_ADD || msg->op == KVS_DELTA_DEL)
+		change_entry(key, msg->op, msg->rank, msg->origin);
+	else{
+		ensure_index_rank(max_rank(msg->num_ranks, ranks));
+		KVS_intern_lock_set(key);
+		pos = locate_set_quiet(key);
+		if(pos >= 0 && (msg->version > entries_baseptr[pos].version || 
+				(msg->version == entries_baseptr[pos].version && msg->origin > entries_baseptr[pos].origin)))
+			put_entry(pos, msg->num_ranks, ranks, msg->version, msg->origin);
+		KVS_intern_unlock_set(key);
+		flush_notifications();
 	}
-	memset(head_baseptr, 0, size);
-	close(fd);
-	free(tmp);
+	kvs_applying = false;
 }
 
-void open_KVS_entries(){
-	char *tmp = malloc(strlen(program_identifier) + strlen(entries_identifier) + 1);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, entries_identifier);
-	int fd;
-	if((fd = shm_open(tmp, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
-		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
-		perror("shm_open encountered: ");
-		exit(-1);
-	}
-	size_t size = sizeof(struct KVS_entry) * head_baseptr->num_entries;
-	if((entries_baseptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == ((void *) -1)){
-		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
-		perror("mmap encountered: ");
-		exit(-1);
+//Apply the next update if one arrived, returns false otherwise. Messages are matched, 
+//so another thread cannot take the update between probe and receive
+bool receive_replica(){
+	int flag, count;
+	MPI_Message message;
+	MPI_Status status;
+	pthread_mutex_lock(&kvs_replica_lock);
+	MPI_Improbe(MPI_ANY_SOURCE, KVS_REPLICA_TAG, kvs_replica_comm, &flag, &message, &status);
+	if(flag){
+		MPI_Get_count(&status, MPI_INT, &count);
+		int *msg = malloc(sizeof(int) * count);
+		MPI_Mrecv(msg, count, MPI_INT, &message, MPI_STATUS_IGNORE);
+		apply_replica(msg);
+		free(msg);
+		__atomic_fetch_add(&kvs_replica_received, 1, __ATOMIC_RELEASE);
 	}
-	close(fd);
-	free(tmp);
+	pthread_mutex_unlock(&kvs_replica_lock);
+	return flag;
 }
 
-void allocate_KVS_entries(){
-	char *tmp = malloc(strlen(program_identifier) + strlen(entries_identifier) + 1);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, entries_identifier);
+//Apply the updates of other nodes that arrived, only does something on node leaders. 
+//Other threads than the main one may call it with MPI_THREAD_MULTIPLE
+void KVS_Progress_replicas(){
+	if(!kvs_is_leader || kvs_applying)
+		return;
+	while(receive_replica());
+}
+
+//Like KVS_Wait_change, but a node leader wakes up every KVS_REPLICA_POLL seconds to 
+//apply the updates of other nodes, which in turn wake the watchers of its node. 
+//Makes MPI calls unlike KVS_Wait_change
+bool KVS_Wait_replicas(int count, double timeout){
+	if(!kvs_is_leader)
+		return KVS_Wait_change(count, timeout);
 	
-	int fd;
-	if((fd = shm_open(tmp, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1){
-		printf("KVS %i: shm_open failed, exiting\n", mpi_world_rank);
-		perror("shm_open encountered: ");
-		exit(-1);
+	double end = kvs_clock() + timeout;
+	for(;;){
+		KVS_Progress_replicas();
+		if(KVS_Get_change_count() != count)
+			return true;
+		double left = end - kvs_clock();
+		if(timeout >= 0 && left <= 0)
+			return false;
+		if(KVS_Wait_change(count, timeout >= 0 && left < KVS_REPLICA_POLL ? left : KVS_REPLICA_POLL))
+			return true;
 	}
-	size_t size = sizeof(struct KVS_entry) * head_baseptr->num_entries;
-	ftruncate(fd, size);
-	if((entries_baseptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == ((void *) -1)){
-		printf("KVS %i: mmap failed, exiting\n", mpi_world_rank);
-		perror("mmap encountered: ");
-		exit(-1);
+}
+
+//Wake everybody sleeping in KVS_Wait_change, e.g. a thread that should stop
+void KVS_Wake_change(){
+	publish_change();
+}
+
+//Collective over MPI_COMM_WORLD, returns once every replica applied the updates 
+//sent before
+void KVS_Sync_replicas(){
+	if(kvs_num_nodes == 1){
+		MPI_Barrier(MPI_COMM_WORLD);
+		return;
 	}
-	memset(entries_baseptr, 0, size);
-	close(fd);
-	free(tmp);
+	
+	int *expected = malloc(sizeof(int) * kvs_num_nodes);
+	MPI_Allreduce(kvs_replica_sent, expected, kvs_num_nodes, MPI_INT, MPI_SUM, kvs_replica_comm);
+	while(kvs_is_leader && __atomic_load_n(&kvs_replica_received, __ATOMIC_ACQUIRE) < expected[kvs_node])
+		receive_replica();
+	free(expected);
+	MPI_Barrier(kvs_replica_comm);
 }
 
-void deallocate_KVS_head(){
-	munmap(head_baseptr, sizeof(struct KVS_head));
-	char *tmp = malloc(strlen(program_identifier) + strlen(head_identifier) + 1);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, head_identifier);
-	shm_unlink(tmp);
-	free(tmp);
+//Collective over MPI_COMM_WORLD, called once the replica of this node is open. 
+//leaders holds the world rank of the leader of every node
+void KVS_Setup_replicas(int node, int num_nodes, const int *leaders){
+	int rank;
+	kvs_node = node;
+	kvs_num_nodes = num_nodes;
+	kvs_leaders = malloc(sizeof(int) * num_nodes);
+	memcpy(kvs_leaders, leaders, sizeof(int) * num_nodes);
+	kvs_replica_sent = calloc(num_nodes, sizeof(int));
+	MPI_Comm_dup(MPI_COMM_WORLD, &kvs_replica_comm);
+	MPI_Comm_rank(kvs_replica_comm, &rank);
+	kvs_is_leader = num_nodes > 1 && leaders[node] == rank;
 }
 
-void deallocate_KVS_entries(){
-	if(munmap(entries_baseptr, sizeof(struct KVS_entry) * head_baseptr->num_entries) == -1){
-		printf("KVS %i: munmap failed, exiting...\n", mpi_world_rank);
-		perror("munmap encountered: ");
+//The sets may also live in kvs_daemon, a separate process every process talks to over a 
+//Unix socket. Writes go to the daemon, which pushes every change to the leaders of the 
+//nodes. They apply it to the arena of their node, so reads stay local
+char kvs_daemon_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+int kvs_daemon_fd = -1; //Requests of this process, connected on first use
+int kvs_daemon_events = -1; //Events, only on node leaders
+pthread_t kvs_daemon_thread;
+bool kvs_daemon_closing = false;
+
+//The threads of a process share kvs_daemon_fd. Every request takes the slot of its id 
+//until its reply was picked up, one waiting thread reads the replies for all of them
+struct KVS_daemon_slot{
+	bool used;
+	bool done; //reply is there
+	int id;
+	struct KVS_daemon_msg reply;
+};
+
+struct KVS_daemon_slot kvs_daemon_slots[KVS_DAEMON_PIPELINE];
+int kvs_daemon_id = 0; //Of the next request
+bool kvs_daemon_reading = false;
+pthread_mutex_t kvs_daemon_lock = PTHREAD_MUTEX_INITIALIZER; //Guards the slots, taken before kvs_daemon_send_lock
+pthread_mutex_t kvs_daemon_send_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t kvs_daemon_cond = PTHREAD_COND_INITIALIZER;
+
+int daemon_connect(){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, kvs_daemon_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+		printf("KVS %i: cannot connect to the daemon at %s\n", mpi_world_rank, kvs_daemon_path);
 		exit(-1);
 	}
-	char *tmp = malloc(strlen(program_identifier) + strlen(entries_identifier) + 1);
-	strcpy(tmp, program_identifier);
-	strcat(tmp, entries_identifier);
-	shm_unlink(tmp);
-	free(tmp);
+	return fd;
 }
 
-void KVS_intern_create_lock(){
-	if(sem_init(&head_baseptr->sem, 1, 1) == -1){
-		printf("KVS %i: sem_init failed, exiting...\n", mpi_world_rank);
-		perror("sem_init encountered: ");
+//Write a request and its ranks with a single call, replies are read with daemon_reply
+void daemon_send(int fd, int id, int op, const char *key, int rank, int num_ranks, const int *ranks){
+	struct KVS_daemon_msg msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.op = op;
+	msg.id = id;
+	msg.rank = rank;
+	msg.num_ranks = num_ranks;
+	strncpy(msg.key, key, KVS_DAEMON_KEY_LENGTH - 1);
+	
+	struct iovec iov[2] = {{&msg, sizeof(msg)}, {(void *)ranks, sizeof(int) * num_ranks}};
+	struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = 2};
+	size_t left = sizeof(msg) + sizeof(int) * num_ranks;
+	while(left > 0){
+		ssize_t n = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0){
+			printf("KVS %i: lost the connection to the daemon\n", mpi_world_rank);
+			exit(-1);
+		}
+		left -= n;
+		while(hdr.msg_iovlen > 0 && (size_t)n >= hdr.msg_iov[0].iov_len){
+			n -= hdr.msg_iov[0].iov_len;
+			hdr.msg_iov++;
+			hdr.msg_iovlen--;
+		}
+		if(hdr.msg_iovlen > 0){
+			hdr.msg_iov[0].iov_base = (char *)hdr.msg_iov[0].iov_base + n;
+			hdr.msg_iov[0].iov_len -= n;
+		}
 	}
 }
 
-void KVS_intern_destroy_lock(){
-	if(sem_destroy(&(head_baseptr->sem)) == -1){
-		printf("KVS %i: sem_destroy failed, exiting...\n", mpi_world_rank);
-		perror("sem_destroy encountered: ");
-	}
+//Nothing the daemon sends is used before it is checked, a malformed message ends the process
+void daemon_malformed(){
+	printf("KVS %i: malformed message from the daemon, exiting\n", mpi_world_rank);
+	exit(-1);
 }
 
-int KVS_intern_lock(){
-	return sem_wait(&head_baseptr->sem);
+bool daemon_rank_valid(int rank){
+	return rank >= 0 && rank < KVS_DAEMON_MAX_RANKS;
 }
 
-int KVS_intern_unlock(){
-	return sem_post(&head_baseptr->sem);
+//Checked before num_ranks is used to find the end of the event
+bool event_header_valid(const struct KVS_daemon_msg *msg){
+	if(msg->op != KVS_DAEMON_EVENT || msg->id < 0 || msg->num_ranks < 0 || msg->num_ranks > KVS_DAEMON_MAX_RANKS)
+		return false;
+	if(msg->key[0] == 0 || memchr(msg->key, 0, KVS_DAEMON_KEY_LENGTH) == NULL)
+		return false;
+	switch(msg->status){
+	case KVS_DAEMON_DESTROY:
+		return msg->num_ranks == 0;
+	case KVS_DAEMON_ADD:
+	case KVS_DAEMON_DEL:
+		return daemon_rank_valid(msg->rank) && msg->version > 0;
+	case KVS_DAEMON_CREATE:
+	case KVS_DAEMON_PUT:
+		return msg->version > 0;
+	default:
+		return false;
+	}
 }
 
-void update_local_memory_info(int setnumber){
-	mem_version[setnumber] = entries_baseptr[setnumber].mem_version;
-	mem_ranks[setnumber] = entries_baseptr[setnumber].mem_ranks;
-	mem_updates[setnumber] = entries_baseptr[setnumber].mem_updates;
+bool event_ranks_valid(int num_ranks, const int *ranks){
+	for(int i = 0; i < num_ranks; i++)
+		if(!daemon_rank_valid(ranks[i]))
+			return false;
+	return true;
 }
 
-//TODO: Add error handling
-int reallocate_memory(int **memory, size_t old_size, size_t new_size){
-	if((*memory = mremap(*memory, old_size, new_size, MREMAP_MAYMOVE)) == (void*)-1){
-		printf("KVS %i: mremap failed, exiting\n", mpi_world_rank);
-		perror("mremap encountered: ");
-		exit(-1);
+struct KVS_daemon_msg daemon_reply(int fd){
+	struct KVS_daemon_msg msg;
+	size_t got = 0;
+	while(got < sizeof(msg)){
+		ssize_t n = read(fd, (char *)&msg + got, sizeof(msg) - got);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0){
+			printf("KVS %i: lost the connection to the daemon\n", mpi_world_rank);
+			exit(-1);
+		}
+		got += n;
 	}
-	return 0;
+	if(msg.op < KVS_DAEMON_RESET || msg.op > KVS_DAEMON_LOOKUP || msg.id < 0 || (msg.status != 0 && msg.status != -1) || msg.rank < 0 || msg.num_ranks != 0)
+		daemon_malformed();
+	return msg;
+}
+
+//Send a request without waiting for the reply, returns its id for daemon_wait. 
+//Blocks while the request KVS_DAEMON_PIPELINE ids before is still waiting
+int daemon_post(int op, const char *key, int rank, int num_ranks, const int *ranks){
+	pthread_mutex_lock(&kvs_daemon_lock);
+	if(kvs_daemon_fd == -1)
+		kvs_daemon_fd = daemon_connect();
+	while(kvs_daemon_slots[kvs_daemon_id % KVS_DAEMON_PIPELINE].used)
+		pthread_cond_wait(&kvs_daemon_cond, &kvs_daemon_lock);
+	int id = kvs_daemon_id;
+	kvs_daemon_id = (kvs_daemon_id + 1) & (INT_MAX >> 1); //Stays a multiple of the pipeline when it wraps
+	struct KVS_daemon_slot *slot = &kvs_daemon_slots[id % KVS_DAEMON_PIPELINE];
+	slot->used = true;
+	slot->done = false;
+	slot->id = id;
+	
+	//Requests go out in the order of their ids
+	pthread_mutex_lock(&kvs_daemon_send_lock);
+	pthread_mutex_unlock(&kvs_daemon_lock);
+	daemon_send(kvs_daemon_fd, id, op, key, rank, num_ranks, ranks);
+	pthread_mutex_unlock(&kvs_daemon_send_lock);
+	return id;
 }
 
-int update_memory(int setnumber){
-	if(mem_version[setnumber] < entries_baseptr[setnumber].mem_version){
-		//Code for the real update here
-		reallocate_memory(&(ranks_baseptr[setnumber]), mem_ranks[setnumber] * sizeof(int), entries_baseptr[setnumber].mem_ranks * sizeof(int));
-		reallocate_memory(&(updates_baseptr[setnumber]), mem_updates[setnumber] * sizeof(int), entries_baseptr[setnumber].mem_updates * sizeof(int));
+//Wait for the reply of the request with id. If no other thread reads the replies, 
+//this one does and hands every reply to the slot with its id
+struct KVS_daemon_msg daemon_wait(int id){
+	struct KVS_daemon_slot *slot = &kvs_daemon_slots[id % KVS_DAEMON_PIPELINE];
+	pthread_mutex_lock(&kvs_daemon_lock);
+	while(!slot->done){
+		if(kvs_daemon_reading){
+			pthread_cond_wait(&kvs_daemon_cond, &kvs_daemon_lock);
+			continue;
+		}
+		kvs_daemon_reading = true;
+		pthread_mutex_unlock(&kvs_daemon_lock);
+		struct KVS_daemon_msg msg = daemon_reply(kvs_daemon_fd);
+		pthread_mutex_lock(&kvs_daemon_lock);
+		kvs_daemon_reading = false;
 		
-		update_local_memory_info(setnumber);
+		struct KVS_daemon_slot *owner = &kvs_daemon_slots[msg.id % KVS_DAEMON_PIPELINE];
+		if(!owner->used || owner->done || owner->id != msg.id)
+			daemon_malformed();
+		owner->reply = msg;
+		owner->done = true;
+		pthread_cond_broadcast(&kvs_daemon_cond);
 	}
-	
-	return 0;
+	struct KVS_daemon_msg reply = slot->reply;
+	slot->used = false;
+	pthread_cond_broadcast(&kvs_daemon_cond);
+	pthread_mutex_unlock(&kvs_daemon_lock);
+	return reply;
 }
 
-int rescale_memory_ranks(int setnumber, int old_mem, int new_mem){
-	reallocate_memory(&(ranks_baseptr[setnumber]), old_mem*sizeof(int), new_mem*sizeof(int));
-	
-	entries_baseptr[setnumber].mem_version++;
-	entries_baseptr[setnumber].mem_ranks = new_mem;
+struct KVS_daemon_msg daemon_request(int op, const char *key, int rank, int num_ranks, const int *ranks){
+	return daemon_wait(daemon_post(op, key, rank, num_ranks, ranks));
 }
 
-int rescale_memory_updates(int setnumber, int old_mem, int new_mem){
-	reallocate_memory(&(updates_baseptr[setnumber]), old_mem*sizeof(int), new_mem*sizeof(int));
+//Wait until the leader of this node applied the events up to seq, so a process 
+//reads its own writes
+void wait_applied(int seq){
+	for(;;){
+		int count = KVS_Get_change_count();
+		if(__atomic_load_n(&(head_baseptr->daemon_seq), __ATOMIC_ACQUIRE) >= seq)
+			return;
+		KVS_Wait_change(count, -1);
+	}
+}
+
+//Events come in the order the daemon made the changes, so they are applied as they are. 
+//Single changes of a rank go to the delta log, everything else replaces the set
+void apply_event(const struct KVS_daemon_msg *msg, int *ranks){
+	char key[KVS_MAX_SET_NAME_LENGTH];
+	memcpy(key, msg->key, KVS_MAX_SET_NAME_LENGTH);
+	key[KVS_MAX_SET_NAME_LENGTH-1] = 0;
 	
-	entries_baseptr[setnumber].mem_version++;
-	entries_baseptr[setnumber].mem_updates = new_mem;
+	if(msg->status == KVS_DAEMON_DESTROY){
+		local_destroy(key);
+		return;
+	}
+	int pos = locate_set_quiet(key);
+	if(pos < 0){
+		create_set(key, msg->num_ranks, ranks, msg->version, kvs_node, kvs_node, -1);
+		return;
+	}
+	if((msg->status == KVS_DAEMON_ADD || msg->status == KVS_DAEMON_DEL) && entries_baseptr[pos].version == msg->version - 1){
+		change_membership(key, msg->status == KVS_DAEMON_ADD ? KVS_DELTA_ADD : KVS_DELTA_DEL, msg->rank);
+		return;
+	}
+	ensure_index_rank(max_rank(msg->num_ranks, ranks));
+	KVS_intern_lock_set(key);
+	put_entry(pos, msg->num_ranks, ranks, msg->version, kvs_node);
+	KVS_intern_unlock_set(key);
 }
 
-//Put the first version of an entry in the KVS. 
-void KVS_Put_initial(char *key, int num_ranks, int *ranks){
-	KVS_intern_lock();
+//Runs on node leaders. All complete events of a read are applied before the 
+//waiting writers are woken
+void *daemon_receive(void *arg){
+	kvs_applying = true;
+	kvs_receiving = true;
+	arena_refresh();
+	size_t len = 0, mem = 2 * KVS_DAEMON_CHUNK;
+	char *buf = malloc(mem);
 	
-	int pos = hash(key, head_baseptr->num_entries);
-	int n = pos;
-	do{
-		if(strlen(entries_baseptr[n].key) == 0){ //TODO: Pretty hacky check
-			
-			if(num_ranks > entries_baseptr[n].mem_ranks){
-				rescale_memory_ranks(n, entries_baseptr[n].mem_ranks, num_ranks);
-			}
+	for(;;){
+		if(mem - len < KVS_DAEMON_CHUNK){
+			mem *= 2;
+			buf = realloc(buf, mem);
+		}
+		ssize_t n = read(kvs_daemon_events, buf + len, mem - len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0){
+			if(__atomic_load_n(&kvs_daemon_closing, __ATOMIC_ACQUIRE))
+				break;
+			printf("KVS %i: lost the connection to the daemon\n", mpi_world_rank);
+			exit(-1);
+		}
+		len += n;
 		
-			head_baseptr->version++;
-			entries_baseptr[n].version = 1;
-			entries_baseptr[n].num_ranks = num_ranks;
-			
-			strcpy(entries_baseptr[n].key, key);
-			entries_baseptr[n].key_length = strlen(key);
-			
-			for(int i = 0; i < num_ranks; i++){
-				ranks_baseptr[n][i] = ranks[i];
-			}
-			
-			KVS_intern_unlock();
-			return;
+		size_t pos = 0;
+		int seq = -1;
+		while(len - pos >= sizeof(struct KVS_daemon_msg)){
+			struct KVS_daemon_msg *msg = (struct KVS_daemon_msg *)(buf + pos);
+			if(!event_header_valid(msg))
+				daemon_malformed();
+			size_t size = sizeof(struct KVS_daemon_msg) + sizeof(int) * (size_t)msg->num_ranks;
+			if(len - pos < size)
+				break;
+			int *ranks = (int *)(buf + pos + sizeof(struct KVS_daemon_msg));
+			if(!event_ranks_valid(msg->num_ranks, ranks))
+				daemon_malformed();
+			apply_event(msg, ranks);
+			seq = msg->id;
+			pos += size;
 		}
-		n = (n + 1) % head_baseptr->num_entries;
-	}while(n!=pos);
-	
-	printf("KVS %i: DID NOT FIND\n", mpi_world_rank);
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+		if(seq >= 0){
+			__atomic_store_n(&(head_baseptr->daemon_seq), seq, __ATOMIC_RELEASE);
+			publish_change();
+		}
+	}
+	free(buf);
+	leave_generation();
+	return NULL;
+}
 
-	//Error, did not find process set
-	KVS_intern_unlock();
+int daemon_put(char *key, int num_ranks, int *ranks){
+	struct KVS_daemon_msg reply = daemon_request(KVS_DAEMON_PUT, key, -1, num_ranks, ranks);
+	if(reply.status != 0)
+		return -1;
+	wait_applied(reply.rank);
+	return 0;
+}
+
+int daemon_create(char *key, int num_ranks, int *ranks){
+	if(strlen(key) == 0 || strlen(key) >= KVS_MAX_SET_NAME_LENGTH || strcmp(key, "mpi://SELF") == 0)
+		return -1;
 	
-	exit(-1);
+	struct KVS_daemon_msg reply = daemon_request(KVS_DAEMON_CREATE, key, -1, num_ranks, ranks);
+	if(reply.status != 0)
+		return -1;
+	wait_applied(reply.rank);
+	return locate_set_quiet(key);
 }
 
-void KVS_Put_internal(char *key, int num_ranks, int *ranks, bool lock){
+int daemon_destroy(char *key){
+	if(strcmp(key, "mpi://WORLD") == 0)
+		return -1;
 	
-	if(lock) KVS_intern_lock();
+	struct KVS_daemon_msg reply = daemon_request(KVS_DAEMON_DESTROY, key, -1, 0, NULL);
+	if(reply.status != 0)
+		return -1;
+	wait_applied(reply.rank);
+	return 0;
+}
+
+int daemon_change(char *key, int op, int rank){
+	struct KVS_daemon_msg reply = daemon_request(op == KVS_DELTA_ADD ? KVS_DAEMON_ADD : KVS_DAEMON_DEL, key, rank, 0, NULL);
+	if(reply.status != 0)
+		return -1;
+	wait_applied(reply.rank);
+	return 0;
+}
+
+//The daemon knows the latest state of the set, the arena has it once the node applied 
+//the events up to the lookup. Destroyed sets are not waited for
+int daemon_lookup(const char *key){
+	struct KVS_daemon_msg reply = daemon_request(KVS_DAEMON_LOOKUP, key, -1, 0, NULL);
+	if(reply.status != 0)
+		return -1;
+	wait_applied(reply.rank);
+	return locate_set_quiet(key);
+}
+
+int daemon_version(const char *key){
+	struct KVS_daemon_msg reply = daemon_request(KVS_DAEMON_LOOKUP, key, -1, 0, NULL);
+	return reply.status == 0 ? reply.version : -1;
+}
+
+//Collective over MPI_COMM_WORLD, once all changes reached the daemon every process 
+//waits for its node to apply them
+void daemon_sync(){
+	MPI_Barrier(MPI_COMM_WORLD);
+	struct KVS_daemon_msg reply = daemon_request(KVS_DAEMON_SYNC, "", -1, 0, NULL);
+	wait_applied(reply.rank);
+	MPI_Barrier(MPI_COMM_WORLD);
+}
+
+int local_version(const char *key){
+	int pos = locate_set_quiet(key);
+	return pos < 0 ? -1 : __atomic_load_n(&(watch_of(pos)->version), __ATOMIC_ACQUIRE);
+}
+
+//Where the sets of this process are kept. lookup gives the entry of the set in the arena 
+//once it is as recent as the backend, views and watches are served from there
+struct KVS_backend{
+	int (*lookup)(const char *);
+	int (*version)(const char *);
+	int (*put)(char *, int, int *);
+	int (*create)(char *, int, int *);
+	int (*destroy)(char *);
+	int (*change)(char *, int, int);
+	void (*sync)();
+};
+
+const struct KVS_backend kvs_local_backend = {locate_set_quiet, local_version, local_put, local_create, local_destroy, change_membership, KVS_Sync_replicas};
+const struct KVS_backend kvs_daemon_backend = {daemon_lookup, daemon_version, daemon_put, daemon_create, daemon_destroy, daemon_change, daemon_sync};
+const struct KVS_backend *kvs_backend = &kvs_local_backend;
+
+int lookup_set(const char *key){
+	return kvs_backend->lookup(key);
+}
+
+//Latest version of the set as known to the backend, -1 if there is no such set
+int KVS_Get_version(char *key){
+	if(strcmp(key, "mpi://SELF") == 0)
+		return 1;
+	return kvs_backend->version(key);
+}
+
+//Collective over MPI_COMM_WORLD, switches to the daemon at path, NULL for the default. 
+//The process with reset replaces the sets of the daemon by the ones of its arena, 
+//leaders subscribe for their node. Spawned processes are not supported
+void KVS_Use_daemon(const char *path, bool leader, bool reset){
+	strncpy(kvs_daemon_path, path != NULL ? path : KVS_DAEMON_SOCKET, sizeof(kvs_daemon_path) - 1);
+	kvs_backend = &kvs_daemon_backend;
 	
-	int pos;
-	if(0 > (pos = locate_set(key))){
-		printf("KVS %i: Put_initial, did not find set\n", mpi_world_rank);
-		exit(-1); 
+	//Pipelined, a reply is only waited for once its slot is needed again
+	if(reset){
+		int ids[KVS_DAEMON_PIPELINE], n = 0;
+		ids[n++] = daemon_post(KVS_DAEMON_RESET, "", -1, 0, NULL);
+		for(int pos = 0; pos < head_baseptr->num_entries; pos++){
+			if(entries_baseptr[pos].key[0] == 0)
+				continue;
+			struct KVS_view view;
+			entry_view(pos, &view);
+			int *ranks = malloc(sizeof(int) * view.num_ranks + 1);
+			int num_ranks = KVS_view_expand(&view, ranks);
+			if(n >= KVS_DAEMON_PIPELINE)
+				daemon_wait(ids[n % KVS_DAEMON_PIPELINE]);
+			ids[n++ % KVS_DAEMON_PIPELINE] = daemon_post(KVS_DAEMON_CREATE, entries_baseptr[pos].key, -1, num_ranks, ranks);
+			free(ranks);
+		}
+		for(int i = n > KVS_DAEMON_PIPELINE ? n - KVS_DAEMON_PIPELINE : 0; i < n; i++)
+			daemon_wait(ids[i % KVS_DAEMON_PIPELINE]);
 	}
+	MPI_Barrier(MPI_COMM_WORLD);
 	
-	update_memory(pos);
-	
-	//Do we change memory size?
-	if(num_ranks > entries_baseptr[pos].mem_ranks){
-		rescale_memory_ranks(pos, entries_baseptr[pos].mem_ranks, num_ranks);
+	if(leader){
+		kvs_daemon_events = daemon_connect();
+		daemon_send(kvs_daemon_events, 0, KVS_DAEMON_SUBSCRIBE, "", -1, 0, NULL);
+		struct KVS_daemon_msg reply = daemon_reply(kvs_daemon_events);
+		__atomic_store_n(&(head_baseptr->daemon_seq), reply.rank, __ATOMIC_RELEASE);
+		pthread_create(&kvs_daemon_thread, NULL, daemon_receive, NULL);
 	}
-	
-	head_baseptr->version++;
-	entries_baseptr[pos].version++;
-	entries_baseptr[pos].num_ranks = num_ranks;
+	MPI_Barrier(MPI_COMM_WORLD);
+}
 
-	for(int i = 0; i < num_ranks; i++){
-		ranks_baseptr[pos][i] = ranks[i];
-	}
-	head_baseptr->version++;
-	
-	//Send out notifications that the set changed
-	int num = KVS_VERSION_UPDATE;
-	for(int i = 0; i < entries_baseptr[pos].num_updates; i++){
-		MPI_Send(&num, 1, MPI_INT, updates_baseptr[pos][i], pos, MPI_COMM_WORLD);
-	}
-	entries_baseptr[pos].num_updates = 0;
-	
-	if(lock) KVS_intern_unlock();
+//Put, Add and Del return -1 if the set does not exist (anymore)
+int KVS_Put(char *key, int num_ranks, int *ranks){
+	return kvs_backend->put(key, num_ranks, ranks);
 }
 
-void KVS_Put(char *key, int num_ranks, int *ranks){
-	KVS_Put_internal(key, num_ranks, ranks, true);
+int KVS_Create(char *key, int num_ranks, int *ranks){
+	return kvs_backend->create(key, num_ranks, ranks);
 }
 
-//fetches the value of a process set from KVS (user must free memory at ranks)
-void KVS_Get_internal(char *key, int *num_ranks, int **ranks, int *version, int *setnumber, bool lock){
-	//For mpi://SELF
-	if(strcmp(key, "mpi://SELF") == 0){
-		*num_ranks = 1;
-		*version = 1;
-		*ranks = (int*)malloc(*num_ranks * sizeof(int) + 1);
-		*ranks[0] = mpi_world_rank;
-		*setnumber = -1; //TODO: Should this even have a setnumber?
+int KVS_Destroy(char *key){
+	return kvs_backend->destroy(key);
+}
 
-		return;
-	}
-	
-	if(lock) KVS_intern_lock();
-	
+int KVS_Add(char *key, int rank){
+	return kvs_backend->change(key, KVS_DELTA_ADD, rank);
+}
+
+int KVS_Del(char *key, int rank){
+	return kvs_backend->change(key, KVS_DELTA_DEL, rank);
+}
+
+//Collective over MPI_COMM_WORLD, returns once every node sees the changes made before
+void KVS_Sync(){
+	kvs_backend->sync();
+}
+
+//Net changes of the members of a set since from_version, taken from its delta log 
+//without locking. Ranks that were added and deleted again are left out, the user 
+//must free added and removed. Returns 0 on success, -1 if the set does not exist and 
+//-2 if the log does not reach back to from_version or the set was replaced as a 
+//whole meanwhile, the caller has to read the whole set then
+int KVS_Get_diff(char *key, int from_version, int *version, int *num_added, int **added, int *num_removed, int **removed){
 	int pos;
-	if(0 > (pos = locate_set(key))){
-		printf("KVS %i: Get_internal, did not find set\n", mpi_world_rank);
-		exit(-1); 
-	}
+	if(strcmp(key, "mpi://SELF") == 0 || 0 > (pos = locate_set_quiet(key)))
+		return -1;
 	
-	update_memory(pos);
+	struct KVS_delta deltas[KVS_LOG_SIZE];
+	int num, deleted;
+	unsigned int seq;
+	do{
+		seq = read_seq_begin(pos);
+		deleted = entries_baseptr[pos].deleted;
+		*version = entries_baseptr[pos].version;
+		int log_count = entries_baseptr[pos].log_count;
+		num = *version - from_version;
+		if(num < 0 || num > KVS_LOG_SIZE || num > log_count)
+			num = -1;
+		for(int i = 0; i < num; i++)
+			deltas[i] = log_of(pos)[(log_count - num + i) % KVS_LOG_SIZE];
+	}while(read_seq_retry(pos, seq));
 	
-	*num_ranks = entries_baseptr[pos].num_ranks;
-	*version = entries_baseptr[pos].version;
-	*ranks = (int*)malloc(*num_ranks * sizeof(int));
-	for(int i = 0; i < *num_ranks; i++){
-		(*ranks)[i] = ranks_baseptr[pos][i];
+	if(deleted)
+		return -1;
+	if(num < 0)
+		return -2;
+	for(int i = 0; i < num; i++){
+		if(deltas[i].op == KVS_DELTA_RESET || deltas[i].version != from_version + i + 1)
+			return -2;
 	}
-	*setnumber = pos;
 	
-	if(lock) KVS_intern_unlock();
+	*num_added = 0;
+	*num_removed = 0;
+	*added = (int*)malloc(num * sizeof(int) + 1);
+	*removed = (int*)malloc(num * sizeof(int) + 1);
+	for(int i = 0; i < num; i++){
+		//Look at every rank once, at its first delta
+		int first = deltas[i].op, last = first, j;
+		for(j = 0; j < i && deltas[j].rank != deltas[i].rank; j++);
+		if(j < i) continue;
+		for(j = i + 1; j < num; j++)
+			if(deltas[j].rank == deltas[i].rank) last = deltas[j].op;
+		
+		if(first == KVS_DELTA_ADD && last == KVS_DELTA_ADD)
+			(*added)[(*num_added)++] = deltas[i].rank;
+		else if(first == KVS_DELTA_DEL && last == KVS_DELTA_DEL)
+			(*removed)[(*num_removed)++] = deltas[i].rank;
+	}
+	return 0;
 }
 
-void KVS_Get(char *key, int *num_ranks, int **ranks, int *version, int *setnumber){
-	KVS_Get_internal(key, num_ranks, ranks, version, setnumber, true);
-}
+//Process local cache of the sets this process is part of, by setnumber
+struct KVS_membership{
+	int version; //Version of the set the entry was derived from, -1 if never
+	bool member;
+	char key[KVS_MAX_SET_NAME_LENGTH]; //Empty for deleted sets
+};
 
-//I cannot lock outside, so I move this inside
-void KVS_Add(char *key, int rank){
-	KVS_intern_lock();
-	
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get_internal(key, &num_ranks, &ranks, &version, &setnumber, false);
-		
-	int *nranks = malloc(sizeof(int) * (num_ranks + 1));
-	for(int i = 0; i < num_ranks; i++)
-		nranks[i] = ranks[i];
-	
-	ranks[num_ranks] = rank;
-	num_ranks++;
-	
-	KVS_Put_internal(key, num_ranks, ranks, false);
-	
-	free(ranks);
-	free(nranks);
-	
-	KVS_intern_unlock();
+struct KVS_membership *kvs_members = NULL;
+int kvs_members_len = 0; //Number of setnumbers covered
+int kvs_members_kvsversion = -1; //Version of the KVS the whole cache was validated at
+
+//Read the name and the membership of this process from the entry, without locking
+void derive_membership(int pos){
+	struct KVS_membership *m = &kvs_members[pos];
+	struct KVS_view view;
+	do{
+		view.seq = read_seq_begin(pos);
+		entry_view(pos, &view);
+		memcpy(m->key, entries_baseptr[pos].key, KVS_MAX_SET_NAME_LENGTH);
+		m->key[KVS_MAX_SET_NAME_LENGTH-1] = 0;
+		m->member = m->key[0] != 0 && view_sane(&view) && KVS_view_contains(&view, mpi_world_rank);
+	}while(read_seq_retry(pos, view.seq));
+	m->version = view.version;
 }
 
-void KVS_Del(char *key, int rank){
-	KVS_intern_lock();
+//Every update changes the version of the KVS, if it did not change the cache is valid. 
+//Otherwise only the sets whose version moved are read again
+void refresh_memberships(){
+	arena_refresh();
+	int kvsversion = __atomic_load_n(&(head_baseptr->version), __ATOMIC_ACQUIRE);
+	if(kvsversion == kvs_members_kvsversion)
+		return;
 	
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get_internal(key, &num_ranks, &ranks, &version, &setnumber, false);
-	for(int i = 0, j = 0; i < num_ranks; i++){
-		if(i != rank){
-			ranks[j] = ranks[i];
-			j++;
+	int num_entries = __atomic_load_n(&(head_baseptr->num_entries), __ATOMIC_ACQUIRE);
+	if(num_entries > kvs_members_len){
+		kvs_members = realloc(kvs_members, sizeof(struct KVS_membership) * num_entries);
+		for(int i = kvs_members_len; i < num_entries; i++){
+			kvs_members[i].version = -1;
+			kvs_members[i].member = false;
 		}
+		kvs_members_len = num_entries;
 	}
-	num_ranks--;
-	KVS_Put_internal(key, num_ranks, ranks, false);
+	
+	for(int i = 0; i < num_entries; i++)
+		if(kvs_members[i].version != KVS_Get_watch_version(i))
+			derive_membership(i);
+	kvs_members_kvsversion = kvsversion;
+}
 
-	free(ranks);
+//True if this process is part of the set, only reads the set again if its version changed. 
+//False if there is no such set
+bool KVS_Check_member(char *key){
+	if(strcmp(key, "mpi://SELF") == 0)
+		return true;
 	
-	KVS_intern_unlock();
+	int pos;
+	if(0 > (pos = lookup_set(key)))
+		return false;
+	if(pos >= kvs_members_len)
+		refresh_memberships();
+	if(kvs_members[pos].version != KVS_Get_watch_version(pos))
+		derive_membership(pos);
+	return kvs_members[pos].member;
 }
 
 //sets up shared memory stores process set information into the KVS
 //Only called by one process, others call KVS_open
 void KVS_initialise(){
 
-	//Setup shared memory and semaphore
-	allocate_KVS_head();
-	head_baseptr->num_entries = mpi_nsets+1;
+	//Setup shared memory and semaphore, the arena starts with room for all 
+	//entries and their initial blocks and grows if needed
+	int num_entries = mpi_nsets+1;
+	size_t estimate = sizeof(struct KVS_head) + (sizeof(struct KVS_entry) + 4 * KVS_MIN_BLOCK * sizeof(int) + 
+		2 * KVS_LOG_SIZE * sizeof(struct KVS_delta) + 32) * num_entries;
+	size_t size = KVS_ARENA_MIN_SIZE;
+	while(size < 2 * estimate) size *= 2;
+	allocate_arena(size);
+	head_baseptr->num_entries = num_entries;
+	head_baseptr->num_sets = num_entries;
+	head_baseptr->table_size = num_entries;
+	head_baseptr->mph_size = num_entries;
 	head_baseptr->version = 0;
 	KVS_intern_create_lock();
 
-	allocate_KVS_entries();
-	allocate_ranks_and_updates();
+	head_baseptr->entries_off = arena_alloc(sizeof(struct KVS_entry) * num_entries);
+	arena_set_pointers();
+	allocate_updates_and_logs();
+	
+	//All names are known now, so build a perfect hash over them
+	char **keys = malloc(sizeof(char*) * head_baseptr->num_entries);
+	keys[0] = strdup("mpi://WORLD");
+	for(int i=0; i<head_baseptr->num_entries-1; i++){
+		keys[i+1] = malloc(strlen(mpi_setnames[i])+10);
+		strcpy(keys[i+1],"app://");
+		strcat(keys[i+1], mpi_setnames[i]);
+	}
+	
+	int *displacements;
+	head_baseptr->mph_buckets = mph_build(keys, head_baseptr->num_entries, &displacements);
+	head_baseptr->probe_size = KVS_PROBE_TABLE_SIZE;
+	head_baseptr->mph_off = arena_alloc(sizeof(int) * head_baseptr->mph_buckets);
+	head_baseptr->probe_off = arena_alloc(sizeof(int) * head_baseptr->probe_size);
+	arena_set_pointers();
+	memcpy(mph_baseptr, displacements, sizeof(int) * head_baseptr->mph_buckets);
+	for(int i = 0; i < head_baseptr->probe_size; i++)
+		probe_baseptr[i] = KVS_PROBE_EMPTY;
+	free(displacements);
+	
+	//Reverse index, sized for the ranks and sets known now
+	head_baseptr->index_ranks = mpi_world_size;
+	head_baseptr->index_words = (num_entries + 63) / 64;
+	head_baseptr->index_off = arena_alloc(sizeof(uint64_t) * mpi_world_size * head_baseptr->index_words);
+	memset(arena_baseptr + head_baseptr->index_off, 0, sizeof(uint64_t) * mpi_world_size * head_baseptr->index_words);
 	
 	//Add world process set
 	int *ranks = malloc(sizeof(int) * mpi_world_size);
 	for(int i = 0; i < mpi_world_size; i++)
 		ranks[i] = i;
-	KVS_Put_initial("mpi://WORLD", mpi_world_size, ranks);
+	KVS_Put_initial(keys[0], mpi_world_size, ranks);
 	free(ranks);
 
 	//Add other process sets
 	for(int i=0; i<head_baseptr->num_entries-1; i++){
-		char *setname = malloc(strlen(mpi_setnames[i])+10);
-		strcpy(setname,"app://");
-		strcat(setname, mpi_setnames[i]);
-		
 		int localrank=0;
 		int num_ranks = mpi_set_upper[i] - mpi_set_lower[i] + 1;
 		int *ranks = malloc(sizeof(int) * num_ranks);
@@ -573,152 +3091,250 @@ void KVS_initialise(){
 			}
 		}
 		
-		KVS_Put_initial(setname, num_ranks, ranks);
+		KVS_Put_initial(keys[i+1], num_ranks, ranks);
 		
 		//no updates in the beginning so no initialization
 		
-		free(setname);
 		free(ranks);
 	}
 	
-	//Local memory information to detect if another process resized a shared 
-	//memory block and then resize yourself
-	mem_version = malloc(sizeof(int)*head_baseptr->num_entries);
-	mem_ranks = malloc(sizeof(int)*head_baseptr->num_entries);
-	mem_updates = malloc(sizeof(int)*head_baseptr->num_entries);
 	for(int i = 0; i < head_baseptr->num_entries; i++)
-		update_local_memory_info(i);
+		free(keys[i]);
+	free(keys);
 }
 
-//get acces to existing KVS
+//get acces to existing KVS, a single mapping of the arena
 void KVS_open(){
-	open_KVS_head();
-	open_KVS_entries();
-	open_ranks_and_updates();
-	
-	mem_version = malloc(sizeof(int)*head_baseptr->num_entries);
-	mem_ranks = malloc(sizeof(int)*head_baseptr->num_entries);
-	mem_updates = malloc(sizeof(int)*head_baseptr->num_entries);
-	for(int i = 0; i < head_baseptr->num_entries; i++)
-		update_local_memory_info(i);
+	open_arena();
 }
 
+//Collective over the node with KVS_Use_window
 void KVS_free()
 {
-	deallocate_ranks_and_updates();
-	deallocate_KVS_entries();
-	deallocate_KVS_head();
+	//Notifications still in flight
+	MPI_Waitall(kvs_num_sends, kvs_sends, MPI_STATUSES_IGNORE);
+	KVS_Progress_notifications();
+	free(kvs_sends);
+	free(kvs_send_buffers);
+	free(kvs_outbox);
+	free(kvs_events);
+	free(kvs_members);
+	free(kvs_leaders);
+	free(kvs_replica_sent);
+	if(kvs_replica_comm != MPI_COMM_NULL)
+		MPI_Comm_free(&kvs_replica_comm);
+	if(kvs_daemon_events != -1){
+		__atomic_store_n(&kvs_daemon_closing, true, __ATOMIC_RELEASE);
+		shutdown(kvs_daemon_events, SHUT_RDWR);
+		pthread_join(kvs_daemon_thread, NULL);
+		close(kvs_daemon_events);
+	}
+	if(kvs_daemon_fd != -1)
+		close(kvs_daemon_fd);
 	
+	leave_generation();
 	KVS_intern_destroy_lock();
-	
-	free(mem_version);
-	free(mem_ranks);
-	free(mem_updates);
+	deallocate_arena();
+}
+
+//Copy the name of a set, returns false if it was deleted
+bool read_key(int pos, char *key){
+	unsigned int seq;
+	do{
+		seq = read_seq_begin(pos);
+		memcpy(key, entries_baseptr[pos].key, KVS_MAX_SET_NAME_LENGTH);
+		key[KVS_MAX_SET_NAME_LENGTH-1] = 0;
+	}while(read_seq_retry(pos, seq));
+	return key[0] != 0;
 }
 
 //Get number of existing process sets(including own mpi://SELF)
 int KVS_Get_global_nsets(){
-	KVS_intern_lock();
-	int ret = head_baseptr->num_entries;
-	KVS_intern_unlock();
+	int ret = __atomic_load_n(&(head_baseptr->num_sets), __ATOMIC_ACQUIRE);
 	return ret+1; //mpi://SELF included
 }
 
-//Get number of process sets this process is part of
+//Get number of process sets this process is part of, from the reverse index
 int KVS_Get_local_nsets(){
-	int global_nsets = KVS_Get_global_nsets();
-	int count = 0;
-	//Check all sets, saved in the KVS
-	for(int i=0; i<global_nsets-1; i++){
-		if(MPI_Session_check_in_processet(entries_baseptr[i].key)){
-			count++;
-		}
-	}
+	int *setnumbers;
+	int n = KVS_Get_sets_of_rank(mpi_world_rank, &setnumbers);
+	free(setnumbers);
 	//for mpi://SELF
-	count++;
-
-	return count;
+	return n + 1;
 }
 
-//fetches the names of all process sets(including own mpi://SELF)
+//fetches the names of all process sets(including own mpi://SELF, last), at most n of them. 
+//Sets deleted meanwhile are left out, n is set to the number of names returned. 
+//If sets are created meanwhile the first n-1 are returned. 
 //returned pointer must be freed by the user
-char** KVS_Get_global_processsets(int n){
-	KVS_intern_lock();
-	
-	char **gps_names = (char**) malloc(sizeof(char*)*n);
-	for(int i=0;i<n-1;i++){ //TODO: HACKY, check whether we really need global mpi://SELFi 
-		gps_names[i] = (char*) malloc(sizeof(char) * entries_baseptr[i].key_length + 1);
-		strcpy(gps_names[i], entries_baseptr[i].key);
+char** KVS_Get_global_processsets(int *n){
+	arena_refresh();
+	int num_entries = __atomic_load_n(&(head_baseptr->num_entries), __ATOMIC_ACQUIRE);
+	char **gps_names = (char**) malloc(sizeof(char*) * *n + 1);
+	char key[KVS_MAX_SET_NAME_LENGTH];
+	int pos = 0;
+	for(int i=0;i<num_entries && pos<*n-1;i++){ //TODO: HACKY, check whether we really need global mpi://SELFi 
+		if(!read_key(i, key)) continue;
+		gps_names[pos] = (char*) malloc(sizeof(char) * strlen(key) + 1);
+		strcpy(gps_names[pos], key);
+		pos++;
 	}
 	//TODO: For now only own mpi://SELF
 	const char s[] = "mpi://SELF";
-	gps_names[n-1] = (char*) malloc(sizeof(char) * (strlen(s)+1));
-	strcpy(gps_names[n-1], s);
+	gps_names[pos] = (char*) malloc(sizeof(char) * (strlen(s)+1));
+	strcpy(gps_names[pos], s);
+	*n = pos + 1;
 	
-	KVS_intern_unlock();
 	return gps_names;
 }
 
-//fetches the names of process sets this process is part of
-//returned pointer must be freed by the user
+//fetches the names of process sets this process is part of(including own mpi://SELF), 
+//n of them, from the reverse index. returned pointer must be freed by the user
 char** KVS_Get_local_processsets(int n){
-	int gnsets = KVS_Get_global_nsets();
-	char **gps_names = KVS_Get_global_processsets(gnsets);
-	char **lps_names = (char**) malloc(sizeof(char*)*n);
+	int num;
+	char **names = KVS_Get_processsets_of_rank(mpi_world_rank, &num);
+	char **lps_names = (char**) malloc(sizeof(char*) * n + 1);
 	
 	int pos = 0;
-	for(int i=0; i<gnsets; i++){
-		if(MPI_Session_check_in_processet(gps_names[i])){
-			lps_names[pos] = (char *) malloc(sizeof(char) * strlen(gps_names[i]) + 1);
-			strcpy(lps_names[pos], gps_names[i]);
-			free(gps_names[i]);
-			pos++;
-		}
+	for(int i=0; i<num; i++){
+		if(pos < n)
+			lps_names[pos++] = names[i];
+		else
+			free(names[i]);
+	}
+	free(names);
+	if(pos < n){
+		const char s[] = "mpi://SELF";
+		lps_names[pos] = (char*) malloc(sizeof(char) * (strlen(s)+1));
+		strcpy(lps_names[pos], s);
+		pos++;
+	}
+	//Sets deleted meanwhile
+	for(; pos<n; pos++){
+		lps_names[pos] = (char*) malloc(sizeof(char));
+		lps_names[pos][0] = 0;
 	}
-	free(gps_names);
 	
 	return lps_names;
 }
 
-//add newly spawned processes to mpi://WORLD, if needed
-void KVS_addto_world(){
-	KVS_intern_lock();
-
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get_internal("mpi://WORLD", &num_ranks, &ranks, &version, &setnumber, false);
-
-	int position = num_ranks;
-	num_ranks = num_ranks + mpi_world_size;
-	int *nranks = malloc(sizeof(int) * num_ranks);
+//fetches the names of the process sets the rank is part of, using the reverse index. 
+//Returns their number, returned pointer must be freed by the user
+char** KVS_Get_processsets_of_rank(int rank, int *n){
+	int *setnumbers;
+	arena_refresh(); //New sets may be beyond the tables this thread knows
+	int num = KVS_Get_sets_of_rank(rank, &setnumbers);
+	char **names = (char**) malloc(sizeof(char*) * num + 1);
+	char key[KVS_MAX_SET_NAME_LENGTH];
 	
-	for(int i = 0; i < position; i++){
-		nranks[i] = ranks[i];
+	*n = 0;
+	for(int i = 0; i < num; i++){
+		//Sets deleted meanwhile are left out
+		if(setnumbers[i] >= kvs_table_size || !read_key(setnumbers[i], key)) continue;
+		names[*n] = (char*) malloc(sizeof(char) * strlen(key) + 1);
+		strcpy(names[*n], key);
+		(*n)++;
 	}
+	free(setnumbers);
+	return names;
+}
+
+//Name, version, size and membership of all process sets(including own mpi://SELF, last) 
+//in one pass over the entries, returns their number. Every update changes the version 
+//of the KVS, the pass is repeated if it moved meanwhile. The last pass keeps the 
+//writers out, so the sets always belong to the same state of the KVS. Returned pointer 
+//must be freed by the user
+int KVS_Get_all_sets(MPI_Pset_summary **sets){
+	MPI_Pset_summary *out = NULL;
+	int n = 0, capacity = 0;
 	
-	for(int i = 0; i < mpi_world_size; i++){
-		nranks[i] = position;
-		position++;
+	for(int pass = 1; ; pass++){
+		bool locked = pass >= KVS_SNAPSHOT_PASSES;
+		if(locked){
+			KVS_intern_lock();
+			for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+				sem_wait(&(head_baseptr->stripes[i]));
+		}
+		arena_refresh();
+		unsigned int generation = kvs_generation;
+		int kvsversion = __atomic_load_n(&(head_baseptr->version), __ATOMIC_ACQUIRE);
+		int num_entries = __atomic_load_n(&(head_baseptr->num_entries), __ATOMIC_ACQUIRE);
+		if(num_entries + 1 > capacity){
+			capacity = num_entries + 1;
+			out = realloc(out, sizeof(MPI_Pset_summary) * capacity);
+		}
+		
+		n = 0;
+		for(int i = 0; i < num_entries; i++){
+			MPI_Pset_summary *set = &out[n];
+			struct KVS_view view;
+			do{
+				view.seq = read_seq_begin(i);
+				entry_view(i, &view);
+				memcpy(set->handle.name, entries_baseptr[i].key, KVS_MAX_SET_NAME_LENGTH);
+				set->member = view_sane(&view) && KVS_view_contains(&view, mpi_world_rank);
+			}while(read_seq_retry(i, view.seq));
+			set->handle.name[KVS_MAX_SET_NAME_LENGTH-1] = 0;
+			if(set->handle.name[0] == 0) continue; //Deleted
+			
+			set->handle.setnumber = i;
+			set->handle.version = view.version;
+			set->handle.size = view.num_ranks;
+			n++;
+		}
+		
+		if(locked){
+			for(int i = 0; i < KVS_LOCK_STRIPES; i++)
+				sem_post(&(head_baseptr->stripes[i]));
+			KVS_intern_unlock();
+			break;
+		}
+		if(__atomic_load_n(&(head_baseptr->generation), __ATOMIC_ACQUIRE) == generation && 
+				__atomic_load_n(&(head_baseptr->version), __ATOMIC_ACQUIRE) == kvsversion)
+			break;
 	}
 	
-	KVS_Put_internal("mpi://WORLD", num_ranks, nranks, false);
+	strcpy(out[n].handle.name, "mpi://SELF");
+	out[n].handle.setnumber = -1;
+	out[n].handle.version = 1;
+	out[n].handle.size = 1;
+	out[n].member = true;
 	
-	free(ranks);
-	free(nranks);
+	*sets = out;
+	return n + 1;
+}
+
+//add newly spawned processes to mpi://WORLD, if needed
+//Goes through the backend like any other change, every rank is added on its own so 
+//changes of mpi://WORLD elsewhere survive
+void KVS_addto_world(){
+	struct KVS_view view;
+	do{
+		KVS_Get_view("mpi://WORLD", &view);
+	}while(!KVS_Release_view(&view));
 	
-	KVS_intern_unlock();
+	for(int i = 0; i < mpi_world_size; i++)
+		kvs_backend->change("mpi://WORLD", KVS_DELTA_ADD, view.num_ranks + i);
 }
 
 void KVS_ask_for_update(int setnumber){
-	KVS_intern_lock();
+	char key[KVS_MAX_SET_NAME_LENGTH];
+	arena_refresh();
+	if(setnumber < 0 || setnumber >= kvs_table_size || !read_key(setnumber, key))
+		return;
+	KVS_intern_lock_set(key);
 
 	int num_updates = entries_baseptr[setnumber].num_updates;
-	if(num_updates >= entries_baseptr[setnumber].mem_updates)
-		rescale_memory_updates(setnumber, entries_baseptr[setnumber].mem_updates, num_updates+1);
+	if(num_updates >= entries_baseptr[setnumber].mem_updates){
+		write_seq_begin(setnumber);
+		rescale_memory_updates(setnumber, entries_baseptr[setnumber].mem_updates, 2*num_updates+1);
+		write_seq_end(setnumber);
+	}
 		
-	updates_baseptr[setnumber][num_updates] = mpi_world_rank;
+	updates_of(setnumber)[num_updates] = mpi_world_rank;
 	entries_baseptr[setnumber].num_updates++;
 
-	KVS_intern_unlock();
+	KVS_intern_unlock_set(key);
 }
 
 //issues a watch on the process set; newly spawned thread is calling this routine
@@ -765,13 +3381,18 @@ int KVS_Watch_keyupdate_blocking(char *set_name){
 	return 1;
 }
 
+//Copy the lookup counters of the calling thread
+void KVS_Get_stats(struct KVS_stats *stats){
+	*stats = kvs_stats;
+}
+
+void KVS_Reset_stats(){
+	memset(&kvs_stats, 0, sizeof(struct KVS_stats));
+}
+
 ///returns the latest version of the key-value store (built-in version number)
 int KVS_Get_kvsversion(){
-	int version; 
-	KVS_intern_lock();
-	version = head_baseptr->version;
-	KVS_intern_unlock();
-	return version;
+	return __atomic_load_n(&(head_baseptr->version), __ATOMIC_ACQUIRE);
 }
 
 
@@ -0,0 +1,346 @@
+/*This file is part of the MPI Sessions library.
+ *
+ *This file, kvs_daemon.c is a KVS daemon that keeps the process sets for the
+ *library when it runs with MPI_SESSIONS_BACKEND=daemon, in place of the KVS of a
+ *resource manager. One daemon serves all processes of a host:
+ *	kvs_daemon [-socket path] [-once]
+ *With -once it exits when the last client disconnected.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <kvs_daemon.h>
+
+#define KVSD_MAX_CLIENTS 1024
+#define KVSD_READ_CHUNK 65536 //Bytes read from a client at once, all complete requests in them are handled
+
+struct set{
+	char key[KVS_DAEMON_KEY_LENGTH]; //Empty if the slot is free
+	int version;
+	int num_ranks;
+	int *ranks;
+};
+
+struct client{
+	int fd;
+	bool subscribed;
+	bool closed;
+	char *in; //Received bytes that do not form a complete request yet
+	size_t in_len, in_mem;
+	char *out; //Replies and events not sent yet, written in one go after every round
+	size_t out_len, out_mem;
+};
+
+struct set *sets = NULL;
+int num_sets = 0, mem_sets = 0;
+struct client clients[KVSD_MAX_CLIENTS];
+int num_clients = 0;
+int sequence = 0; //Number of events so far
+
+struct set *find_set(const char *key){
+	for(int i = 0; i < num_sets; i++)
+		if(sets[i].key[0] != 0 && strcmp(sets[i].key, key) == 0)
+			return &sets[i];
+	return NULL;
+}
+
+struct set *new_set(const char *key){
+	int i;
+	for(i = 0; i < num_sets && sets[i].key[0] != 0; i++);
+	if(i == num_sets){
+		if(num_sets == mem_sets){
+			mem_sets = 2 * mem_sets + 16;
+			sets = realloc(sets, sizeof(struct set) * mem_sets);
+		}
+		num_sets++;
+	}
+	strcpy(sets[i].key, key);
+	sets[i].version = 0;
+	sets[i].num_ranks = 0;
+	sets[i].ranks = NULL;
+	return &sets[i];
+}
+
+void set_ranks(struct set *set, int num_ranks, const int *ranks){
+	set->ranks = realloc(set->ranks, sizeof(int) * num_ranks + 1);
+	memcpy(set->ranks, ranks, sizeof(int) * num_ranks);
+	set->num_ranks = num_ranks;
+}
+
+int find_rank(const struct set *set, int rank){
+	for(int i = 0; i < set->num_ranks; i++)
+		if(set->ranks[i] == rank)
+			return i;
+	return -1;
+}
+
+bool rank_valid(int rank){
+	return rank >= 0 && rank < KVS_DAEMON_MAX_RANKS;
+}
+
+bool ranks_valid(int num_ranks, const int *ranks){
+	for(int i = 0; i < num_ranks; i++)
+		if(!rank_valid(ranks[i]))
+			return false;
+	return true;
+}
+
+void append(struct client *c, const void *data, size_t len){
+	if(c->out_len + len > c->out_mem){
+		c->out_mem = 2 * (c->out_len + len);
+		c->out = realloc(c->out, c->out_mem);
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+void reply(struct client *c, const struct KVS_daemon_msg *request, int status, int version){
+	struct KVS_daemon_msg msg = *request;
+	msg.status = status;
+	msg.version = version;
+	msg.rank = sequence;
+	msg.num_ranks = 0;
+	append(c, &msg, sizeof(msg));
+}
+
+//Every subscriber gets the whole new state of the set, NULL if it was destroyed
+void publish(const struct KVS_daemon_msg *request, const struct set *set){
+	struct KVS_daemon_msg msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.op = KVS_DAEMON_EVENT;
+	msg.id = ++sequence;
+	msg.status = request->op;
+	msg.rank = request->rank;
+	strcpy(msg.key, request->key);
+	if(set != NULL){
+		msg.version = set->version;
+		msg.num_ranks = set->num_ranks;
+	}
+
+	for(int i = 0; i < num_clients; i++){
+		if(!clients[i].subscribed || clients[i].closed) continue;
+		append(&clients[i], &msg, sizeof(msg));
+		if(set != NULL)
+			append(&clients[i], set->ranks, sizeof(int) * set->num_ranks);
+	}
+}
+
+//The key of the request is terminated and num_ranks is in bounds, receive checked that
+void handle(struct client *c, struct KVS_daemon_msg *request, const int *ranks){
+	struct set *set = find_set(request->key);
+
+	switch(request->op){
+	case KVS_DAEMON_RESET:
+		for(int i = 0; i < num_sets; i++)
+			free(sets[i].ranks);
+		num_sets = 0;
+		reply(c, request, 0, 0);
+		break;
+	case KVS_DAEMON_CREATE:
+		if(set != NULL || request->key[0] == 0 || !ranks_valid(request->num_ranks, ranks)){
+			reply(c, request, -1, 0);
+			break;
+		}
+		set = new_set(request->key);
+		set->version = 1;
+		set_ranks(set, request->num_ranks, ranks);
+		publish(request, set);
+		reply(c, request, 0, set->version);
+		break;
+	case KVS_DAEMON_DESTROY:
+		if(set == NULL){
+			reply(c, request, -1, 0);
+			break;
+		}
+		free(set->ranks);
+		set->ranks = NULL;
+		set->key[0] = 0;
+		publish(request, NULL);
+		reply(c, request, 0, 0);
+		break;
+	case KVS_DAEMON_PUT:
+		if(set == NULL || !ranks_valid(request->num_ranks, ranks)){
+			reply(c, request, -1, 0);
+			break;
+		}
+		set_ranks(set, request->num_ranks, ranks);
+		set->version++;
+		publish(request, set);
+		reply(c, request, 0, set->version);
+		break;
+	case KVS_DAEMON_ADD:
+	case KVS_DAEMON_DEL:
+		if(set == NULL || !rank_valid(request->rank)){
+			reply(c, request, -1, 0);
+			break;
+		}
+		//Adding a member or deleting a non-member changes nothing
+		int i = find_rank(set, request->rank);
+		if((i >= 0) == (request->op == KVS_DAEMON_ADD)){
+			reply(c, request, 0, set->version);
+			break;
+		}
+		if(request->op == KVS_DAEMON_ADD){
+			set->ranks = realloc(set->ranks, sizeof(int) * (set->num_ranks + 1));
+			set->ranks[set->num_ranks++] = request->rank;
+		}
+		else
+			memmove(set->ranks + i, set->ranks + i + 1, sizeof(int) * (--set->num_ranks - i));
+		set->version++;
+		publish(request, set);
+		reply(c, request, 0, set->version);
+		break;
+	case KVS_DAEMON_SUBSCRIBE:
+		c->subscribed = true;
+		reply(c, request, 0, 0);
+		break;
+	case KVS_DAEMON_SYNC:
+		reply(c, request, 0, 0);
+		break;
+	case KVS_DAEMON_LOOKUP:
+		if(set == NULL)
+			reply(c, request, -1, 0);
+		else
+			reply(c, request, 0, set->version);
+		break;
+	default:
+		reply(c, request, -1, 0);
+	}
+}
+
+//Handle all complete requests in the input of the client
+void receive(struct client *c){
+	if(c->in_len + KVSD_READ_CHUNK > c->in_mem){
+		c->in_mem = c->in_len + 2 * KVSD_READ_CHUNK;
+		c->in = realloc(c->in, c->in_mem);
+	}
+	ssize_t n = read(c->fd, c->in + c->in_len, KVSD_READ_CHUNK);
+	if(n <= 0){
+		if(n == 0 || (errno != EAGAIN && errno != EINTR))
+			c->closed = true;
+		return;
+	}
+	c->in_len += n;
+
+	size_t pos = 0;
+	while(c->in_len - pos >= sizeof(struct KVS_daemon_msg)){
+		struct KVS_daemon_msg *request = (struct KVS_daemon_msg *)(c->in + pos);
+		if(request->num_ranks < 0 || request->num_ranks > KVS_DAEMON_MAX_RANKS || memchr(request->key, 0, KVS_DAEMON_KEY_LENGTH) == NULL){
+			c->closed = true;
+			return;
+		}
+		size_t len = sizeof(struct KVS_daemon_msg) + sizeof(int) * (size_t)request->num_ranks;
+		if(c->in_len - pos < len)
+			break;
+		struct KVS_daemon_msg msg = *request;
+		int *ranks = malloc(sizeof(int) * msg.num_ranks + 1);
+		memcpy(ranks, c->in + pos + sizeof(msg), sizeof(int) * msg.num_ranks);
+		handle(c, &msg, ranks);
+		free(ranks);
+		pos += len;
+	}
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+}
+
+void send_pending(struct client *c){
+	if(c->out_len == 0 || c->closed)
+		return;
+	ssize_t n = write(c->fd, c->out, c->out_len);
+	if(n < 0){
+		if(errno != EAGAIN && errno != EINTR)
+			c->closed = true;
+		return;
+	}
+	memmove(c->out, c->out + n, c->out_len - n);
+	c->out_len -= n;
+}
+
+int main(int argc, char **argv){
+	const char *path = getenv("MPI_SESSIONS_DAEMON");
+	bool once = false;
+	if(path == NULL)
+		path = KVS_DAEMON_SOCKET;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-socket") == 0 && i + 1 < argc)
+			path = argv[++i];
+		else if(strcmp(argv[i], "-once") == 0)
+			once = true;
+		else{
+			printf("usage: %s [-socket path] [-once]\n", argv[0]);
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if(listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 128) == -1){
+		perror("kvs_daemon: cannot listen on the socket");
+		return 1;
+	}
+
+	struct pollfd fds[KVSD_MAX_CLIENTS + 1];
+	bool served = false;
+	while(!once || !served || num_clients > 0){
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for(int i = 0; i < num_clients; i++){
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = POLLIN | (clients[i].out_len > 0 ? POLLOUT : 0);
+		}
+		if(poll(fds, num_clients + 1, -1) == -1){
+			if(errno == EINTR) continue;
+			perror("kvs_daemon: poll");
+			return 1;
+		}
+
+		int polled = num_clients;
+		for(int i = 0; i < polled; i++){
+			if(fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))
+				receive(&clients[i]);
+		}
+		//Everything for a client that came up in this round goes out with one write
+		for(int i = 0; i < polled; i++)
+			send_pending(&clients[i]);
+
+		if((fds[0].revents & POLLIN) && num_clients < KVSD_MAX_CLIENTS){
+			int fd = accept(listener, NULL, NULL);
+			if(fd >= 0){
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				memset(&clients[num_clients], 0, sizeof(struct client));
+				clients[num_clients++].fd = fd;
+				served = true;
+			}
+		}
+
+		int n = 0;
+		for(int i = 0; i < num_clients; i++){
+			if(clients[i].closed){
+				close(clients[i].fd);
+				free(clients[i].in);
+				free(clients[i].out);
+				continue;
+			}
+			clients[n++] = clients[i];
+		}
+		num_clients = n;
+	}
+
+	close(listener);
+	unlink(path);
+	return 0;
+}
@@ -20,7 +20,8 @@
 #include <sys/stat.h>
 #include <semaphore.h>
 
-int mpi_nsets=0, mpi_local_nsets=0, mpi_global_nsets=0, mpi_world_rank, 
+int mpi_nsets=0, mpi_num_setnames=0, mpi_local_nsets=0, mpi_global_nsets=0, mpi_local_names_n=0,
+    mpi_global_names_n=0, mpi_world_rank, 
     mpi_world_size, mpi_setnumber, *mpi_setsizes=NULL, *mpi_set_lower=NULL, 
     *mpi_set_upper=NULL, *mpi_namelengths=NULL, *mpi_displs=NULL, 
     *mpi_keyupdate_flag=NULL;
@@ -28,22 +29,163 @@ char **mpi_setnames=NULL, **mpi_local_process_sets=NULL,
      **mpi_global_process_sets=NULL; 
 char *mpi_unique_name=NULL, *mpi_totalstring=NULL;
 
-char *program_identifier = "/mpisessions"; //Should be set by mpirun to allow multiple programs, used to created shared memory
+char *program_identifier = "/mpisessions"; //Names the shared memory, made unique per job by name_job
+char job_identifier[128]; //program_identifier of this job, see name_job
+char vnode_identifier[sizeof(job_identifier) + 16]; //program_identifier of a virtual node, see split_vnodes
 
 MPI_Request *requests; 
-int buff;
+int **watch_buffers; //Receive buffers of the requests, notifications may carry ranks to pass them on to
+int *watch_versions; //Futex and mailbox mode: version of the watched sets when the watch started, -1 if none
+struct KVS_event *watch_events; //Mailbox mode: change that completed the watch of the set
+int num_requests = 0;
+
+#define WATCH_FUTEX 0
+#define WATCH_MPI 1
+#define WATCH_MAILBOX 2
+
+//Watchers on this node wait on the version word of the set in the shared memory by 
+//default. MPI_SESSIONS_WATCH=mpi makes them register for MPI notifications instead, 
+//MPI_SESSIONS_WATCH=mailbox has writers push the changes to a mailbox of the watcher
+int watch_mode = WATCH_FUTEX;
 
 MPI_Group mpi_world_group;
 MPI_Comm mpi_world_comm;
+MPI_Comm mpi_node_comm = MPI_COMM_NULL; //Ranks sharing the KVS of this node
+
+//Handlers called by the progress thread when their set changed
+struct pset_callback{
+	char name[50];
+	int setnumber;
+	int version; //Last version the handler was called for, or registered with
+	MPI_Session_pset_callback fn;
+	void *arg;
+};
+
+struct pset_callback *callbacks = NULL;
+int num_callbacks = 0, mem_callbacks = 0;
+pthread_mutex_t callbacks_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t progress_thread;
+bool progress_running = false;
+
+//Groups and communicators of the versions of the sets, a version never changes its 
+//members, so they can be handed out again until the set moves on
+struct group_cache_entry{
+	char name[50];
+	int version;
+	MPI_Group group;
+	MPI_Comm comm; //MPI_COMM_NULL until one was created from the group
+	int group_refs, comm_refs; //Handles given out and not released yet
+	bool stale; //A newer version of the set was seen, freed once not referenced anymore
+};
+
+struct group_cache_entry *group_cache = NULL;
+int num_group_cache = 0, mem_group_cache = 0;
+
+//MPI_SESSIONS_THREADS=multiple initialises MPI with MPI_THREAD_MULTIPLE, communicators 
+//are then created in the background by MPI_Comm_icreate_from_group
+int mpi_thread_level = MPI_THREAD_SINGLE;
+
+#define CREATION_SET_BITS 12 //Low bits of a creation tag hold the setnumber, the version is above
+
+//Communicator created in the background, behind a generalized request
+struct comm_creation{
+	MPI_Group group;
+	MPI_Comm *comm;
+	int tag;
+	MPI_Request request;
+	bool cached; //Result was put into the group cache
+};
+
+//Communicator for the next version of a watched set, built speculatively once the 
+//watch returned. Allocated one by one, a creation in the background writes to comm
+struct prebuilt_comm{
+	char name[50];
+	int watched; //Version the watch was registered for, the one after it is built
+	int version; //Version it is built for, -1 while none is
+	MPI_Group group;
+	MPI_Comm comm;
+	MPI_Request request;
+};
+
+bool prebuild = false; //Set by MPI_Session_set_prebuild
+struct prebuilt_comm **prebuilt = NULL; //By setnumber, NULL for sets not watched with prebuilding
+int num_prebuilt = 0;
+//Creations nobody waits for anymore, because a newer watch returned before they completed. 
+//They are handed back once they completed, the others never joined them if they do not
+struct prebuilt_comm **abandoned = NULL;
+int num_abandoned = 0, mem_abandoned = 0;
+MPI_Session prebuild_session;
+
+//Post the receive for notifications about the set
+void post_watch(int setnumber){
+	if(watch_buffers[setnumber] == NULL)
+		watch_buffers[setnumber] = malloc(sizeof(int) * KVS_NOTIFY_MSG_LEN);
+	MPI_Irecv(watch_buffers[setnumber], KVS_NOTIFY_MSG_LEN, MPI_INT, MPI_ANY_SOURCE, 
+		setnumber, MPI_COMM_WORLD, requests + setnumber);
+}
 
 void update_request(MPI_Request *req, int setnumber)
 {
 	if(*req != MPI_REQUEST_NULL){
 		MPI_Cancel(req);
 		MPI_Request_free(req);
-		int buff;
-		MPI_Irecv(&buff, 1, MPI_INT, MPI_ANY_SOURCE, setnumber, MPI_COMM_WORLD, req);
+		post_watch(setnumber);
+	}
+}
+
+//Sets created at runtime get new setnumbers, make room for their requests
+void ensure_requests(int setnumber){
+	if(setnumber < num_requests)
+		return;
+	
+	int n = num_requests;
+	while(n <= setnumber) n = 2*n + 1;
+	requests = realloc(requests, sizeof(MPI_Request) * n);
+	watch_buffers = realloc(watch_buffers, sizeof(int*) * n);
+	watch_versions = realloc(watch_versions, sizeof(int) * n);
+	watch_events = realloc(watch_events, sizeof(struct KVS_event) * n);
+	for(int i = num_requests; i < n; i++){
+		requests[i] = MPI_REQUEST_NULL;
+		watch_buffers[i] = NULL;
+		watch_versions[i] = -1;
+		watch_events[i] = (struct KVS_event){-1, 0, KVS_DELTA_RESET, -1};
+	}
+	num_requests = n;
+}
+
+//setnumber stored in the info of a process set, -1 for mpi://SELF and for 
+//MPI_INFO_NULL, the info of a set that did not exist
+int info_setnumber(MPI_Info ps_info){
+	char setnumber_str[12];
+	int info_flag;
+
+	if(ps_info == MPI_INFO_NULL)
+		return -1;
+	MPI_Info_get(ps_info, "setnumber", 12, setnumber_str, &info_flag);
+	if(!info_flag)
+		return -1;
+	return strtol(setnumber_str, NULL, 10);
+}
+
+//Read the info of MPI_Session_get_set_info back into a handle, for the MPI_Info 
+//variants of the routines
+void info_to_handle(MPI_Info ps_info, MPI_Pset_handle *handle){
+	char version_str[12], size_str[12];
+	int info_flag;
+
+	if(ps_info == MPI_INFO_NULL){
+		memset(handle, 0, sizeof(MPI_Pset_handle));
+		handle->setnumber = -1;
+		return;
 	}
+	MPI_Info_get(ps_info, "version", 12, version_str, &info_flag);
+	handle->version = info_flag ? strtol(version_str, NULL, 10) : 0;
+	MPI_Info_get(ps_info, "size", 12, size_str, &info_flag);
+	handle->size = info_flag ? strtol(size_str, NULL, 10) : 0;
+	MPI_Info_get(ps_info, "setname", MPI_PSET_NAME_LEN - 1, handle->name, &info_flag);
+	if(!info_flag)
+		handle->name[0] = 0;
+	handle->setnumber = info_setnumber(ps_info);
 }
 
 //The MPI standard routine MPI_Comm_spawn is directed to this 
@@ -54,6 +196,14 @@ int MPIS_Comm_spawn(char *command, char *argv[], int maxprocs, MPI_Info info,
 
 	int val = PMPI_Comm_spawn(command, MPI_ARGV_NULL, maxprocs, MPI_INFO_NULL, 
 		root, comm, intercomm, NULL);
+	
+	//The children open the KVS of our first rank
+	int rank;
+	char name[sizeof(vnode_identifier)];
+	MPI_Comm_rank(comm, &rank);
+	strncpy(name, program_identifier, sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	MPI_Bcast(name, sizeof(name), MPI_CHAR, rank == 0 ? MPI_ROOT : MPI_PROC_NULL, *intercomm);
 
 	debug_print_KVS(false);
 
@@ -66,7 +216,7 @@ int MPIS_Comm_spawn(char *command, char *argv[], int maxprocs, MPI_Info info,
 	mpi_world_comm = intracomm;
 	
 	//Update all requests to use new communicator,doing it explictly now, later global array?
-	for(int i = 0; i < mpi_nsets; i++)
+	for(int i = 0; i < num_requests; i++)
 		update_request(requests + i, i);
 
 	//Make this exit only if spawned processes are done as well
@@ -76,9 +226,52 @@ int MPIS_Comm_spawn(char *command, char *argv[], int maxprocs, MPI_Info info,
 }
 
 
+//Jobs on the same host must not share the KVS. Rank 0 of MPI_COMM_WORLD names it 
+//after its host and process id, which no other running job has, and spawned 
+//processes get the name from their parents
+void name_job(){
+	if(mpi_world_rank == 0){
+		char host[MPI_MAX_PROCESSOR_NAME];
+		int len;
+		MPI_Get_processor_name(host, &len);
+		snprintf(job_identifier, sizeof(job_identifier), "%s_%.64s_%ld", program_identifier, host, (long) getpid());
+	}
+	MPI_Bcast(job_identifier, sizeof(job_identifier), MPI_CHAR, 0, MPI_COMM_WORLD);
+	program_identifier = job_identifier;
+}
+
+//MPI_SESSIONS_VNODES=k splits every node into k virtual nodes with a replica of the 
+//KVS each, to run the replication on a single host
+void split_vnodes(){
+	char *env = getenv("MPI_SESSIONS_VNODES");
+	int vnodes = env != NULL ? strtol(env, NULL, 10) : 1;
+	if(vnodes <= 1){
+		return;
+	}
+	
+	int node_rank, node_size;
+	MPI_Comm_rank(mpi_node_comm, &node_rank);
+	MPI_Comm_size(mpi_node_comm, &node_size);
+	if(vnodes > node_size){
+		vnodes = node_size;
+	}
+	int vnode = node_rank * vnodes / node_size;
+	
+	MPI_Comm vnode_comm;
+	MPI_Comm_split(mpi_node_comm, vnode, 0, &vnode_comm);
+	MPI_Comm_free(&mpi_node_comm);
+	mpi_node_comm = vnode_comm;
+	snprintf(vnode_identifier, sizeof(vnode_identifier), "%s_%d", program_identifier, vnode);
+	program_identifier = vnode_identifier;
+}
+
 //initialises the library environment and stores process set information in KVS
 void MPI_Session_preparation(int argc, char **argv){
-	MPI_Init(&argc, &argv);
+	char *threads = getenv("MPI_SESSIONS_THREADS");
+	if(threads != NULL && strcmp(threads, "multiple") == 0)
+		MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_level);
+	else
+		MPI_Init(&argc, &argv);
 	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_world_rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
 
@@ -100,15 +293,45 @@ void MPI_Session_preparation(int argc, char **argv){
 		MPI_Session_uniquename();
 		MPI_Session_gather_processnames(mpi_world_rank,mpi_world_size);
 		
+		//Every node has its own replica of the KVS, set up by its lowest rank from the 
+		//sets rank 0 read. The others only wait for the leader of their node
+		int node_rank, node, num_nodes, *leader_ranks;
+		MPI_Comm leaders;
+		name_job();
+		MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &mpi_node_comm);
+		split_vnodes();
+		MPI_Comm_rank(mpi_node_comm, &node_rank);
+		char *backend = getenv("MPI_SESSIONS_BACKEND");
+		if(backend != NULL && strcmp(backend, "rma") == 0){
+			//MPI_SESSIONS_WINDOW_SIZE=n gives the window n MiB instead of the default
+			char *window_size = getenv("MPI_SESSIONS_WINDOW_SIZE");
+			KVS_Use_window(mpi_node_comm, window_size != NULL ? strtoul(window_size, NULL, 10) << 20 : 0);
+		}
+		MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, 0, &leaders);
+		
 		//add processes to mpi://WORLD
-		if(mpi_world_rank == 0){
+		if(node_rank == 0){
+			MPI_Comm_rank(leaders, &node);
+			MPI_Comm_size(leaders, &num_nodes);
+			MPI_Session_broadcast_setparameters(leaders);
 			KVS_initialise();
-			MPI_Barrier(MPI_COMM_WORLD);
 		}
-		else{
-			MPI_Barrier(MPI_COMM_WORLD);
+		MPI_Bcast(&num_nodes, 1, MPI_INT, 0, mpi_node_comm);
+		leader_ranks = malloc(sizeof(int) * num_nodes);
+		if(node_rank == 0){
+			MPI_Allgather(&mpi_world_rank, 1, MPI_INT, leader_ranks, 1, MPI_INT, leaders);
+			MPI_Comm_free(&leaders);
+		}
+		MPI_Bcast(&node, 1, MPI_INT, 0, mpi_node_comm);
+		MPI_Bcast(leader_ranks, num_nodes, MPI_INT, 0, mpi_node_comm);
+		if(node_rank != 0){
 			KVS_open(false);
 		}
+		KVS_Setup_replicas(node, num_nodes, leader_ranks);
+		free(leader_ranks);
+		if(backend != NULL && strcmp(backend, "daemon") == 0){
+			KVS_Use_daemon(getenv("MPI_SESSIONS_DAEMON"), node_rank == 0, mpi_world_rank == 0);
+		}
 		//usng mpi://WORLD to generate a world group and a world communicator
 
 		MPI_Create_worldgroup_from_ps();
@@ -120,9 +343,19 @@ void MPI_Session_preparation(int argc, char **argv){
 	//child process
 	else{
 		MPI_Session_uniquename();	
+		
+		//The window was allocated by the ranks of the node before we existed
+		char *backend = getenv("MPI_SESSIONS_BACKEND");
+		if(backend != NULL && strcmp(backend, "rma") == 0){
+			printf("Spawned processes cannot attach to the KVS with MPI_SESSIONS_BACKEND=rma, exiting\n");
+			exit(-1);
+		}
 
 		//MPI_Session_gather_processnames(mpi_world_rank, mpi_world_size);
 
+		//The KVS of the first rank of the parents, see MPIS_Comm_spawn
+		MPI_Bcast(vnode_identifier, sizeof(vnode_identifier), MPI_CHAR, 0, parent);
+		program_identifier = vnode_identifier;
 		KVS_open();
 		debug_print_KVS(true);
 		
@@ -151,14 +384,31 @@ void MPI_Session_preparation(int argc, char **argv){
 		MPI_Barrier(MPI_COMM_WORLD);
 	}
 	
+	//Other ranks may already be creating sets, so the parsed ones are counted apart
+	mpi_num_setnames = mpi_nsets;
  	mpi_nsets = KVS_Get_global_nsets();
-	requests = malloc(sizeof(MPI_Request) * mpi_nsets);
-	for(int i = 0; i < mpi_nsets; i++) requests[i] = MPI_REQUEST_NULL;
+	requests = NULL;
+	watch_buffers = NULL;
+	watch_versions = NULL;
+	watch_events = NULL;
+	char *mode = getenv("MPI_SESSIONS_WATCH");
+	char *backend = getenv("MPI_SESSIONS_BACKEND");
+	bool daemon = !flag && backend != NULL && strcmp(backend, "daemon") == 0;
+	if(mode != NULL && strcmp(mode, "mpi") == 0 && daemon && mpi_world_rank == 0)
+		printf("MPI_SESSIONS_WATCH=mpi does not work with the KVS daemon, using futex\n");
+	if(mode != NULL && strcmp(mode, "mpi") == 0 && !daemon)
+		watch_mode = WATCH_MPI;
+	else if(mode != NULL && strcmp(mode, "mailbox") == 0){
+		watch_mode = WATCH_MAILBOX;
+		KVS_Open_mailbox();
+	}
+	ensure_requests(mpi_nsets - 1);
 }
 
 //create a session
 void MPI_Session_init(MPI_Session** mpisession){
 	*mpisession = malloc(sizeof(MPI_Session));
+	(*mpisession)->group = MPI_GROUP_NULL;
 }
 
 //fetch the local number of process sets
@@ -182,6 +432,17 @@ void MPI_Session_get_global_nsets(MPI_Session** mpisession, int *n){
 	mpi_global_nsets = *n;
 }
 
+//free a names array handed out by get_(global_)pset_names
+void free_names(char **names, int n){
+	if(names == NULL){
+		return;
+	}
+	for(int i=0; i<n; i++){
+		free(names[i]);
+	}
+	free(names);
+}
+
 //fetch the names of process sets
 void MPI_Session_get_pset_names(MPI_Session** mpisession, char*** names, int n){
 
@@ -189,21 +450,77 @@ void MPI_Session_get_pset_names(MPI_Session** mpisession, char*** names, int n){
 		return;
 	}
 
+	//sets may come and go at runtime, so remember how many names this array holds
 	mpi_local_process_sets = KVS_Get_local_processsets(n);
+	mpi_local_names_n = n;
 	*(names)=mpi_local_process_sets;
 }
 
-//fetch the names of all the process sets
+//fetch the names of all the process sets, n of them (see MPI_Session_get_global_nsets). 
+//Sets deleted meanwhile leave empty names at the end, MPI_Session_get_live_pset_names 
+//leaves them out instead
 void MPI_Session_get_global_pset_names(MPI_Session** mpisession, 
 		char*** names, int n){
 
-	if(mpisession == NULL){
+	if(mpisession == NULL || n < 1){
 		return;
 	}
 
+	int found = n;
+	mpi_global_process_sets = KVS_Get_global_processsets(&found);
+	mpi_global_process_sets = realloc(mpi_global_process_sets, sizeof(char*) * n + 1);
+	for(int i = found; i < n; i++)
+		mpi_global_process_sets[i] = calloc(1, 1);
+	mpi_global_names_n = n;
+	
+	*(names)=mpi_global_process_sets;
+}
+
+//fetch the names of all the process sets, at most n of them (see 
+//MPI_Session_get_global_nsets). Sets deleted meanwhile are left out, n is set to the 
+//number of names fetched
+int MPI_Session_get_live_pset_names(MPI_Session** mpisession, char*** names, int *n){
+	if(mpisession == NULL || *n < 1){
+		return MPI_ERR_ARG;
+	}
+
 	mpi_global_process_sets = KVS_Get_global_processsets(n);
+	mpi_global_names_n = *n;
 	
 	*(names)=mpi_global_process_sets;
+	return MPI_SUCCESS;
+}
+
+//fetch the names of the process sets the rank is part of, without mpi://SELF. 
+//names must be freed by the user
+int MPI_Session_get_psets_of_rank(int rank, int *n, char ***names){
+	if(rank < 0)
+		return MPI_ERR_RANK;
+	*names = KVS_Get_processsets_of_rank(rank, n);
+	return MPI_SUCCESS;
+}
+
+//wait until the replicas of all nodes applied the changes made so far, collective 
+//over MPI_COMM_WORLD. Until then other nodes may still see the old process sets
+int MPI_Session_sync_psets(MPI_Session** mpisession){
+	if(mpisession == NULL){
+		return MPI_ERR_ARG;
+	}
+	
+	KVS_Sync();
+	return MPI_SUCCESS;
+}
+
+//fetch name, version, size and membership of all process sets in one consistent pass 
+//over the KVS, with mpi://SELF last. psets is a single allocation, to be freed by the user
+int MPI_Session_get_all_psets_info(MPI_Session** mpisession, int *n, MPI_Pset_summary **psets){
+	if(mpisession == NULL){
+		return MPI_ERR_ARG;
+	}
+	
+	*n = KVS_Get_all_sets(psets);
+	mpi_global_nsets = *n;
+	return MPI_SUCCESS;
 }
 
 //create a world group from the process set mpi://WORLD
@@ -220,80 +537,511 @@ void MPI_Create_worldgroup_from_ps(){
 	free(ranks);
 }
 
-//create a group for a process set
-void MPI_Group_create_from_session(MPI_Session** mpisession, char* set_name, 
-	MPI_Group* group, MPI_Info set_info){
+struct group_cache_entry *cache_find(char *set_name, int version){
+	for(int i = 0; i < num_group_cache; i++)
+		if(group_cache[i].version == version && strcmp(group_cache[i].name, set_name) == 0)
+			return &group_cache[i];
+	return NULL;
+}
+
+struct group_cache_entry *cache_find_group(MPI_Group group){
+	for(int i = 0; i < num_group_cache; i++)
+		if(group_cache[i].group == group)
+			return &group_cache[i];
+	return NULL;
+}
+
+struct group_cache_entry *cache_find_comm(MPI_Comm comm){
+	for(int i = 0; i < num_group_cache; i++)
+		if(group_cache[i].comm == comm)
+			return &group_cache[i];
+	return NULL;
+}
+
+//Free the entry if it is stale and nobody holds its handles anymore
+void cache_collect(struct group_cache_entry *entry){
+	if(!entry->stale || entry->group_refs > 0 || entry->comm_refs > 0)
+		return;
+	if(entry->comm != MPI_COMM_NULL)
+		MPI_Comm_free(&(entry->comm));
+	MPI_Group_free(&(entry->group));
+	*entry = group_cache[--num_group_cache];
+}
+
+//Versions of the set older than version are not handed out anymore
+void cache_evict_older(char *set_name, int version){
+	for(int i = num_group_cache - 1; i >= 0; i--){
+		if(group_cache[i].version < version && strcmp(group_cache[i].name, set_name) == 0){
+			group_cache[i].stale = true;
+			cache_collect(&group_cache[i]);
+		}
+	}
+}
+
+void cache_insert(char *set_name, int version, MPI_Group group){
+	if(strlen(set_name) >= 50)
+		return;
+	if(num_group_cache == mem_group_cache){
+		mem_group_cache = 2 * mem_group_cache + 1;
+		group_cache = realloc(group_cache, sizeof(struct group_cache_entry) * mem_group_cache);
+	}
+	struct group_cache_entry *entry = &group_cache[num_group_cache++];
+	strcpy(entry->name, set_name);
+	entry->version = version;
+	entry->group = group;
+	entry->comm = MPI_COMM_NULL;
+	entry->group_refs = 1;
+	entry->comm_refs = 0;
+	entry->stale = false;
+}
+
+//give back a group from MPI_Group_create_from_session, instead of MPI_Group_free. 
+//Other holders of a cached group share its handle, MPI_Group_free would free it under them
+int MPI_Session_release_group(MPI_Group *group){
+	struct group_cache_entry *entry = cache_find_group(*group);
+	if(entry == NULL){
+		if(*group != MPI_GROUP_NULL)
+			MPI_Group_free(group);
+		return MPI_SUCCESS;
+	}
+	if(entry->group_refs > 0)
+		entry->group_refs--;
+	*group = MPI_GROUP_NULL;
+	cache_collect(entry);
+	return MPI_SUCCESS;
+}
+
+//give back a communicator from MPI_Comm_create_from_group, instead of MPI_Comm_free. 
+//All members have to release it, the last release of a stale one frees it collectively
+int MPI_Session_release_comm(MPI_Comm *comm){
+	struct group_cache_entry *entry = cache_find_comm(*comm);
+	if(entry == NULL){
+		if(*comm != MPI_COMM_NULL)
+			MPI_Comm_free(comm);
+		return MPI_SUCCESS;
+	}
+	if(entry->comm_refs > 0)
+		entry->comm_refs--;
+	*comm = MPI_COMM_NULL;
+	cache_collect(entry);
+	return MPI_SUCCESS;
+}
+
+//create a group for the version of the process set in the handle. The group of a version 
+//is created once and handed out again while the set does not change, give it back with 
+//MPI_Session_release_group
+void MPI_Group_create_from_pset_handle(MPI_Session** mpisession, MPI_Pset_handle *handle, 
+	MPI_Group* group){
 
 	if(mpisession == NULL){
 		return;
 	}
 	
-	char version_str[10];
-	int info_flag, version_from_process;	
-
-	MPI_Info_get(set_info, "version", 10, version_str, &info_flag);	
-	version_from_process = strtol(version_str, NULL, 10);
+	char *set_name = handle->name;
+	int version_from_process = handle->version;
 	
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get(set_name, &num_ranks, &ranks, &version, &setnumber);
+	struct group_cache_entry *cached = cache_find(set_name, version_from_process);
+	if(cached != NULL && !cached->stale){
+		cached->group_refs++;
+		*(group) = cached->group;
+		(*mpisession)->group = cached->group;
+		return;
+	}
 	
-	if(version != version_from_process){
-		*(group) = MPI_GROUP_NULL;
-		return; 
+	//Take the ranks from the shared memory in their compact form and only hand 
+	//them to MPI once the view turned out to be consistent
+	struct KVS_view view;
+	int (*ranges)[3] = NULL, *ranks = NULL, num = 0;
+	bool use_ranges;
+	for(;;){
+		//Destroyed meanwhile
+		if(!KVS_Get_view(set_name, &view)){
+			free(ranges);
+			free(ranks);
+			*(group) = MPI_GROUP_NULL;
+			return;
+		}
+		
+		//The set changed meanwhile, use the version the caller knows if it is still kept
+		if(view.version != version_from_process){
+			if(!KVS_Release_view(&view)) continue;
+			if(!KVS_Get_view_version(set_name, version_from_process, &view)){
+				free(ranges);
+				free(ranks);
+				*(group) = MPI_GROUP_NULL;
+				return; 
+			}
+		}
+		
+		use_ranges = view.rep == KVS_REP_RANGES && view.num_deltas == 0;
+		if(use_ranges){
+			num = view.len / 2;
+			ranges = realloc(ranges, sizeof(int[3]) * num + 1);
+			for(int i = 0; i < num; i++){
+				ranges[i][0] = view.data[2*i];
+				ranges[i][1] = view.data[2*i+1];
+				ranges[i][2] = 1;
+			}
+		}
+		else{
+			ranks = realloc(ranks, sizeof(int) * view.num_ranks + 1);
+			num = KVS_view_expand(&view, ranks);
+		}
+		
+		if(KVS_Release_view(&view)) break;
 	}
 	
 	MPI_Group new_group;
-	MPI_Group_incl(mpi_world_group, num_ranks, ranks, &new_group);
+	if(use_ranges)
+		MPI_Group_range_incl(mpi_world_group, num, ranges, &new_group);
+	else
+		MPI_Group_incl(mpi_world_group, num, ranks, &new_group);
+	free(ranges);
+	free(ranks);
 	*(group) = new_group;
+	
+	cache_evict_older(set_name, view.version);
+	if(cache_find(set_name, version_from_process) == NULL)
+		cache_insert(set_name, version_from_process, new_group);
 
-	(*mpisession)->group = &new_group; 
+	(*mpisession)->group = new_group;
+}
 
-	free(ranks);
+//create a group for a process set
+void MPI_Group_create_from_session(MPI_Session** mpisession, char* set_name, 
+	MPI_Group* group, MPI_Info set_info){
+
+	if(mpisession == NULL || strlen(set_name) >= MPI_PSET_NAME_LEN){
+		return;
+	}
+	
+	MPI_Pset_handle handle;
+	info_to_handle(set_info, &handle);
+	strcpy(handle.name, set_name);
+	MPI_Group_create_from_pset_handle(mpisession, &handle, group);
+}
+
+//Checks for MPI_Comm_(i)create_from_group whether there is anything to create. 
+//Returns true if comm is final already, because there is no group or it was cached. 
+//The group holds the version of the handle, older versions that were pinned or are 
+//still kept get their communicator as well
+bool comm_create_done(MPI_Group group, MPI_Comm* comm){
+	if(group == MPI_GROUP_NULL){
+		*(comm) = MPI_COMM_NULL;
+		return true;
+	}
+	
+	struct group_cache_entry *cached = cache_find_group(group);
+	if(cached != NULL && cached->comm != MPI_COMM_NULL){
+		cached->comm_refs++;
+		*(comm) = cached->comm;
+		return true;
+	}
+	return false;
+}
+
+//Remember the communicator created from a cached group
+void cache_set_comm(MPI_Group group, MPI_Comm comm){
+	struct group_cache_entry *cached = cache_find_group(group);
+	if(cached != NULL && cached->comm == MPI_COMM_NULL && comm != MPI_COMM_NULL){
+		cached->comm = comm;
+		cached->comm_refs = 1;
+	}
+}
+
+//create a communicator from a group of the process set in the handle, for the version 
+//in the handle even if the set changed since. For groups of 
+//MPI_Group_create_from_session the communicator is created once per version, all members 
+//get it back without a collective call while the set does not change. Give it back 
+//with MPI_Session_release_comm
+void MPI_Comm_create_from_pset_handle(MPI_Group group, MPI_Pset_handle *handle, MPI_Comm* comm){
+	if(comm_create_done(group, comm))
+		return;
+	
+	MPI_Comm new_comm;
+
+	MPI_Comm_create_group(mpi_world_comm, group, 0, &new_comm);
+	*(comm) = new_comm;
+	
+	cache_set_comm(group, new_comm);
 }
 
 //create a communicator from a group
 void MPI_Comm_create_from_group(MPI_Group group, char *tag, MPI_Comm* comm, 
 	MPI_Info set_info){
+	
+	MPI_Pset_handle handle;
+	info_to_handle(set_info, &handle);
+	MPI_Comm_create_from_pset_handle(group, &handle, comm);
+}
 
-	if(group == MPI_GROUP_NULL){
-		*(comm) = MPI_COMM_NULL;
-		return;
+//Called from MPI_Test/MPI_Wait in the thread of the user once the creation completed, 
+//so the group cache is only touched by that thread
+int comm_creation_query(void *extra_state, MPI_Status *status){
+	struct comm_creation *creation = extra_state;
+	if(!creation->cached){
+		cache_set_comm(creation->group, *(creation->comm));
+		creation->cached = true;
 	}
+	MPI_Status_set_elements(status, MPI_BYTE, 0);
+	MPI_Status_set_cancelled(status, 0);
+	status->MPI_SOURCE = MPI_UNDEFINED;
+	status->MPI_TAG = MPI_UNDEFINED;
+	return MPI_SUCCESS;
+}
 
-	char version_str[10], setname[50];
-	int info_flag, version_from_process;
+int comm_creation_free(void *extra_state){
+	free(extra_state);
+	return MPI_SUCCESS;
+}
 
-	MPI_Info_get(set_info, "version", 10, version_str, &info_flag);
-	version_from_process = strtol(version_str, NULL, 10);
-	MPI_Info_get(set_info, "setname", 50, setname, &info_flag);
+//A collective call that already started can not be taken back
+int comm_creation_cancel(void *extra_state, int complete){
+	return MPI_SUCCESS;
+}
 
-	int latest_version = MPI_Session_fetch_latestversion(setname);
+//Tag of the creation of the version in the handle on mpi_world_comm. Every set and 
+//version gets its own tag, so overlapping creations never match up and members that 
+//disagree about the version never complete. 0 if it does not fit below MPI_TAG_UB, the 
+//creation is then done right away with the tag of the blocking ones
+int creation_tag(MPI_Pset_handle *handle){
+	int info_flag, *ub;
+	MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &ub, &info_flag);
+	long tag_ub = info_flag ? *ub : 32767;
+	
+	if(handle->setnumber < 0 || handle->setnumber >= (1 << CREATION_SET_BITS) || handle->version < 0)
+		return 0;
+	long tag = 1 + (((long)handle->version << CREATION_SET_BITS) | handle->setnumber);
+	return tag <= tag_ub ? (int)tag : 0;
+}
 
-	if(latest_version != version_from_process){
-		printf("danger2 from %d\n",mpi_world_rank);fflush(stdout);
-		*(comm) = MPI_COMM_NULL;
+void *comm_creation_run(void *arg){
+	struct comm_creation *creation = arg;
+	MPI_Comm_create_group(mpi_world_comm, creation->group, creation->tag, creation->comm);
+	MPI_Grequest_complete(creation->request); //creation may be freed from here on
+	return NULL;
+}
+
+//create a communicator from a group of the process set in the handle without blocking, 
+//comm is valid once the request completed. Creations of different process sets by the 
+//same members may overlap. Without MPI_THREAD_MULTIPLE (see MPI_SESSIONS_THREADS) the 
+//communicator is created right away and the request is complete already
+int MPI_Comm_icreate_from_pset_handle(MPI_Group group, MPI_Pset_handle *handle, MPI_Comm* comm, 
+	MPI_Request *request){
+	
+	struct comm_creation *creation = malloc(sizeof(struct comm_creation));
+	creation->group = group;
+	creation->comm = comm;
+	creation->cached = false;
+	creation->tag = creation_tag(handle);
+	MPI_Grequest_start(comm_creation_query, comm_creation_free, comm_creation_cancel, creation, request);
+	creation->request = *request;
+	
+	if(comm_create_done(group, comm)){
+		creation->cached = true;
+		MPI_Grequest_complete(*request);
+		return MPI_SUCCESS;
+	}
+	
+	if(mpi_thread_level < MPI_THREAD_MULTIPLE || creation->tag == 0){
+		MPI_Comm_create_group(mpi_world_comm, group, creation->tag, comm);
+		MPI_Grequest_complete(*request);
+		return MPI_SUCCESS;
+	}
+	
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int ret = pthread_create(&thread, &attr, comm_creation_run, creation);
+	pthread_attr_destroy(&attr);
+	if(ret != 0){
+		MPI_Comm_create_group(mpi_world_comm, group, creation->tag, comm);
+		MPI_Grequest_complete(*request);
+	}
+	return MPI_SUCCESS;
+}
+
+//create a communicator from a group without blocking
+int MPI_Comm_icreate_from_group(MPI_Group group, char *tag, MPI_Comm* comm, 
+	MPI_Info set_info, MPI_Request *request){
+	
+	MPI_Pset_handle handle;
+	info_to_handle(set_info, &handle);
+	return MPI_Comm_icreate_from_pset_handle(group, &handle, comm, request);
+}
+
+//build the communicator of the new version of a watched process set in the background 
+//once its watch returns, fetch it with MPI_Session_get_prebuilt_comm. Every member of 
+//the new version has to watch the set with prebuilding, otherwise the creation never 
+//completes. All of them build the version after the one in the handle (or info) the 
+//watch was registered with, so they have to watch with the same version. Needs 
+//MPI_THREAD_MULTIPLE, see MPI_SESSIONS_THREADS
+int MPI_Session_set_prebuild(bool enable){
+	if(enable && mpi_thread_level < MPI_THREAD_MULTIPLE)
+		return MPI_ERR_UNSUPPORTED_OPERATION;
+	prebuild = enable;
+	return MPI_SUCCESS;
+}
+
+void prebuild_register(int setnumber, char *set_name, int version){
+	if(setnumber < 0 || strlen(set_name) >= 50)
 		return;
+	if(setnumber >= num_prebuilt){
+		int n = 2 * setnumber + 1;
+		prebuilt = realloc(prebuilt, sizeof(struct prebuilt_comm*) * n);
+		for(int i = num_prebuilt; i < n; i++)
+			prebuilt[i] = NULL;
+		num_prebuilt = n;
 	}
-	MPI_Comm new_comm;
+	if(prebuilt[setnumber] == NULL){
+		prebuilt[setnumber] = malloc(sizeof(struct prebuilt_comm));
+		prebuilt[setnumber]->version = -1;
+	}
+	strcpy(prebuilt[setnumber]->name, set_name);
+	prebuilt[setnumber]->watched = version;
+}
 
-	MPI_Comm_create_group(mpi_world_comm, group, 0, &new_comm);
-	*(comm) = new_comm;
+//Hand back what was built for an older version and nobody picked up, the creation 
+//completed already
+void prebuild_discard(struct prebuilt_comm *entry){
+	MPI_Session_release_comm(&(entry->comm));
+	MPI_Session_release_group(&(entry->group));
+	entry->version = -1;
 }
 
-//TODO: Update
-//initiate asychronous watch on a process set
-void MPI_Session_iwatch_pset(MPI_Info *ps_info){
-	char setnumber_str[10], setname[50];
-	int info_flag, setnumber;
+void prebuild_abandon(struct prebuilt_comm *entry){
+	if(num_abandoned == mem_abandoned){
+		mem_abandoned = 2 * mem_abandoned + 4;
+		abandoned = realloc(abandoned, sizeof(struct prebuilt_comm*) * mem_abandoned);
+	}
+	abandoned[num_abandoned++] = entry;
+}
+
+//Hand back the abandoned creations that completed meanwhile, without waiting for the others
+void prebuild_collect(){
+	int n = 0;
+	for(int i = 0; i < num_abandoned; i++){
+		int done;
+		MPI_Test(&(abandoned[i]->request), &done, MPI_STATUS_IGNORE);
+		if(done){
+			prebuild_discard(abandoned[i]);
+			free(abandoned[i]);
+			continue;
+		}
+		abandoned[n++] = abandoned[i];
+	}
+	num_abandoned = n;
+}
+
+//Called when the watch of the set returned. Members may see different versions by then, 
+//so all of them build the version after the watched one, which the KVS still knows from 
+//the delta log of the set. A creation of an older version that is still running is 
+//abandoned, a speculative creation is never waited for
+void prebuild_start(int setnumber){
+	if(!prebuild || setnumber < 0 || setnumber >= num_prebuilt || prebuilt[setnumber] == NULL)
+		return;
+	prebuild_collect();
+	struct prebuilt_comm *entry = prebuilt[setnumber];
+	
+	//A second creation of the same version would use the same tag as the first one
+	int version = entry->watched + 1;
+	if(entry->version == version)
+		return;
+	for(int i = 0; i < num_abandoned; i++)
+		if(abandoned[i]->version == version && strcmp(abandoned[i]->name, entry->name) == 0)
+			return;
+	
+	if(entry->version >= 0){
+		int done;
+		MPI_Test(&(entry->request), &done, MPI_STATUS_IGNORE);
+		if(done)
+			prebuild_discard(entry);
+		else{
+			prebuild_abandon(entry);
+			prebuilt[setnumber] = malloc(sizeof(struct prebuilt_comm));
+			*(prebuilt[setnumber]) = *entry;
+			entry = prebuilt[setnumber];
+			entry->version = -1;
+		}
+	}
+	
+	MPI_Session *session = &prebuild_session;
+	MPI_Pset_handle handle;
+	strcpy(handle.name, entry->name);
+	handle.setnumber = setnumber;
+	handle.version = version;
+	MPI_Group_create_from_pset_handle(&session, &handle, &(entry->group));
+	if(entry->group == MPI_GROUP_NULL)
+		return; //The version is gone already, the application builds a newer one itself
+	
+	int rank;
+	MPI_Group_rank(entry->group, &rank);
+	if(rank == MPI_UNDEFINED){
+		MPI_Session_release_group(&(entry->group));
+		return;
+	}
+	MPI_Group_size(entry->group, &(handle.size));
+	
+	entry->version = handle.version;
+	MPI_Comm_icreate_from_pset_handle(entry->group, &handle, &(entry->comm), &(entry->request));
+}
 
-	MPI_Info_get(*ps_info, "setnumber", 10, setnumber_str, &info_flag);
-	MPI_Info_get(*ps_info, "setname", 50, setname, &info_flag);		
-	setnumber = strtol(setnumber_str, NULL, 10);
+//fetch the communicator that was built for the new version of the process set after 
+//its watch returned, along with its group and version. Give them back with 
+//MPI_Session_release_comm/group. MPI_ERR_PENDING means it is not ready yet, 
+//MPI_ERR_ARG that none is being built
+int MPI_Session_get_prebuilt_comm(char *set_name, MPI_Group *group, MPI_Comm *comm, int *version){
+	for(int i = 0; i < num_prebuilt; i++){
+		struct prebuilt_comm *entry = prebuilt[i];
+		if(entry == NULL || entry->version < 0 || strcmp(entry->name, set_name) != 0)
+			continue;
+		
+		int done;
+		MPI_Test(&(entry->request), &done, MPI_STATUS_IGNORE);
+		if(!done)
+			return MPI_ERR_PENDING;
+		*group = entry->group;
+		*comm = entry->comm;
+		*version = entry->version;
+		entry->version = -1;
+		return MPI_SUCCESS;
+	}
+	return MPI_ERR_ARG;
+}
+
+//initiate asychronous watch on the process set in the handle
+void MPI_Session_iwatch_pset_handle(MPI_Pset_handle *handle){
+	int setnumber = handle->setnumber;
+	if(setnumber < 0)
+		return; //mpi://SELF never changes
+	ensure_requests(setnumber);
+	if(prebuild)
+		prebuild_register(setnumber, handle->name, handle->version);
+	
+	//Any change of the version from now on
+	if(watch_mode == WATCH_FUTEX){
+		watch_versions[setnumber] = KVS_Get_watch_version(setnumber);
+		return;
+	}
+	
+	if(watch_mode == WATCH_MAILBOX){
+		int version = KVS_Get_watch_version(setnumber);
+		watch_versions[setnumber] = version;
+		watch_events[setnumber].setnumber = -1;
+		KVS_ask_for_update(setnumber);
+		
+		//A change before we were registered is not pushed to the mailbox
+		int latest = KVS_Get_watch_version(setnumber);
+		if(latest != version)
+			watch_events[setnumber] = (struct KVS_event){setnumber, latest, KVS_DELTA_RESET, -1};
+		return;
+	}
 		
 	KVS_ask_for_update(setnumber);
 	
 	//Wait till someone sends a notification
-	MPI_Irecv(&buff, 1, MPI_INT, MPI_ANY_SOURCE, setnumber, MPI_COMM_WORLD, requests + setnumber);
+	post_watch(setnumber);
 	/*
 	pthread_t watch_thread;
 	pthread_create(&watch_thread, NULL, KVS_Watch_keyupdate, ps_info);*/
@@ -302,28 +1050,102 @@ void MPI_Session_iwatch_pset(MPI_Info *ps_info){
 }
 
 //TODO: Update
-//initiate a blocking watch on the process set
+//initiate asychronous watch on a process set
+void MPI_Session_iwatch_pset(MPI_Info *ps_info){
+	MPI_Pset_handle handle;
+	info_to_handle(*ps_info, &handle);
+	MPI_Session_iwatch_pset_handle(&handle);
+}
+
+//TODO: Update
+//initiate a blocking watch on the process set, returns 0 if there is no such set
 int MPI_Session_watch_pset(char *set_name){
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get(set_name, &num_ranks, &ranks, &version, &setnumber);
-	free(ranks);
+	struct KVS_view view;
+	if(!KVS_Get_view(set_name, &view))
+		return 0;
+	KVS_Release_view(&view); //Only the setnumber is needed, it does not change
+	int setnumber = view.setnumber;
+	
+	//A node leader has to apply the updates of other nodes while it waits
+	if(watch_mode != WATCH_MPI){
+		int version = KVS_Get_watch_version(setnumber);
+		for(;;){
+			int count = KVS_Get_change_count();
+			if(KVS_Get_watch_version(setnumber) != version)
+				return 1;
+			KVS_Wait_replicas(count, -1);
+		}
+	}
 	
 	KVS_ask_for_update(setnumber);
-	int buff;
-	MPI_Recv(&buff, 1, MPI_INT, MPI_ANY_SOURCE, setnumber, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	int buff[KVS_NOTIFY_MSG_LEN];
+	MPI_Status status;
+	MPI_Recv(buff, KVS_NOTIFY_MSG_LEN, MPI_INT, MPI_ANY_SOURCE, setnumber, MPI_COMM_WORLD, &status);
+	KVS_Notification_received(setnumber, buff, &status);
 	return 1;
 }
 
-//fetch the latest version number of a process set
+//fetch the latest version number of a process set, -1 if there is no such set
 int MPI_Session_fetch_latestversion(char *set_name){
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get(set_name, &num_ranks, &ranks, &version, &setnumber);
-	free(ranks);
-	return version;
+	return KVS_Get_version(set_name);
 	//Should I really have an extra function for this?
 	//return FLUX_Fetch_latestversion(set_name);
 }
 
+//create a new process set at runtime, returns MPI_ERR_ARG if the name is taken and 
+//MPI_ERR_NO_MEM if the KVS window is full (MPI_SESSIONS_BACKEND=rma)
+int MPI_Session_create_pset(char *set_name, int num_ranks, int *ranks){
+	int ret = KVS_Create(set_name, num_ranks, ranks);
+	if(ret == -2)
+		return MPI_ERR_NO_MEM;
+	if(ret < 0)
+		return MPI_ERR_ARG;
+	return MPI_SUCCESS;
+}
+
+//delete a process set, watchers of the set are notified
+int MPI_Session_destroy_pset(char *set_name){
+	if(KVS_Destroy(set_name) < 0)
+		return MPI_ERR_ARG;
+	return MPI_SUCCESS;
+}
+
+//fetch the members added to and removed from a process set since from_version, 
+//the user must free added and removed. MPI_ERR_TRUNCATE means the changes are no 
+//longer known and the whole set has to be read again
+int MPI_Session_get_pset_diff(char *set_name, int from_version, int *version, 
+		int *num_added, int **added, int *num_removed, int **removed){
+	switch(KVS_Get_diff(set_name, from_version, version, num_added, added, num_removed, removed)){
+	case 0:
+		return MPI_SUCCESS;
+	case -2:
+		return MPI_ERR_TRUNCATE;
+	default:
+		return MPI_ERR_ARG;
+	}
+}
+
+//keep a version of a process set available for MPI_Group_create_from_session 
+//until it is unpinned, e.g. while a collective setup with that version runs
+int MPI_Session_pin_version(char *set_name, int version){
+	switch(KVS_Pin_version(set_name, version)){
+	case 0:
+		return MPI_SUCCESS;
+	case -2:
+		return MPI_ERR_TRUNCATE;
+	case -3:
+		return MPI_ERR_NO_MEM;
+	default:
+		return MPI_ERR_ARG;
+	}
+}
+
+int MPI_Session_unpin_version(char *set_name, int version){
+	if(KVS_Unpin_version(set_name, version) < 0)
+		return MPI_ERR_ARG;
+	return MPI_SUCCESS;
+}
+
 //remove the processes from this process set
 void MPI_Session_deletefrom_pset(char *set_name, int n){
 	KVS_Del(set_name, mpi_world_rank);
@@ -404,6 +1226,43 @@ void MPI_Session_compute_setparameters(int count, char** values){
 	*/
 }
 
+//hand the sets read by rank 0 to the other node leaders, rank 0 of leaders
+void MPI_Session_broadcast_setparameters(MPI_Comm leaders){
+	int leader_rank;
+	MPI_Comm_rank(leaders, &leader_rank);
+	MPI_Bcast(&mpi_nsets, 1, MPI_INT, 0, leaders);
+	
+	if(leader_rank != 0){
+		mpi_setnames = (char**) malloc (sizeof(char*) * mpi_nsets);
+		for (int i=0; i<mpi_nsets; i++) {
+			mpi_setnames[i] = (char *) malloc (sizeof(char) * MPI_PSET_NAME_LEN);
+		}
+		mpi_setsizes = (int *) malloc (sizeof(int) * mpi_nsets);
+		mpi_set_lower = (int *) malloc (sizeof(int) * mpi_nsets);
+		mpi_set_upper = (int *) malloc (sizeof(int) * mpi_nsets);
+	}
+	
+	//Names in one message
+	char *names = malloc(sizeof(char) * MPI_PSET_NAME_LEN * mpi_nsets + 1);
+	if(leader_rank == 0){
+		for (int i=0; i<mpi_nsets; i++) {
+			strncpy(names + i * MPI_PSET_NAME_LEN, mpi_setnames[i], MPI_PSET_NAME_LEN);
+		}
+	}
+	MPI_Bcast(names, MPI_PSET_NAME_LEN * mpi_nsets, MPI_CHAR, 0, leaders);
+	if(leader_rank != 0){
+		for (int i=0; i<mpi_nsets; i++) {
+			memcpy(mpi_setnames[i], names + i * MPI_PSET_NAME_LEN, MPI_PSET_NAME_LEN);
+			mpi_setnames[i][MPI_PSET_NAME_LEN-1] = 0;
+		}
+	}
+	free(names);
+	
+	MPI_Bcast(mpi_setsizes, mpi_nsets, MPI_INT, 0, leaders);
+	MPI_Bcast(mpi_set_lower, mpi_nsets, MPI_INT, 0, leaders);
+	MPI_Bcast(mpi_set_upper, mpi_nsets, MPI_INT, 0, leaders);
+}
+
 //check if the process belongs to the process set
 //TODO: I am not using the name, but the ranks here,
 //should probably be changed for a real implementation
@@ -413,45 +1272,416 @@ int MPI_Session_check_in_processet(char *ps_name){
 		MPI_Session_uniquename();
 	}
 	
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get(ps_name, &num_ranks, &ranks, &version, &setnumber);
+	//Cached per process, only read again once the set changed
+	return KVS_Check_member(ps_name);
+}
 
-	for(int i = 0; i < num_ranks; i++){
-		if(mpi_world_rank == ranks[i]){
-			free(ranks);
-			return 1;
+//Hand the events in the mailbox of this process to the sets that are watched, 
+//without locking. If events were lost, every watched set that changed gets a reset
+void drain_mailbox(){
+	if(KVS_Poll_events() == 0)
+		return;
+	
+	struct KVS_event event;
+	while(KVS_Next_event(&event)){
+		if(event.setnumber >= 0){
+			if(event.setnumber < num_requests && watch_versions[event.setnumber] >= 0 && 
+					watch_events[event.setnumber].setnumber < 0)
+				watch_events[event.setnumber] = event;
+			continue;
+		}
+		for(int i = 0; i < num_requests; i++){
+			int version = KVS_Get_watch_version(i);
+			if(watch_versions[i] >= 0 && watch_events[i].setnumber < 0 && version != watch_versions[i])
+				watch_events[i] = (struct KVS_event){i, version, KVS_DELTA_RESET, -1};
 		}
 	}
-	free(ranks);
-	return 0;
+}
+
+//Returns 1 if the watch on the set completed, the watch is consumed then
+int check_watch(int setnumber){
+	//Changes of other nodes only complete watches once the leader applied them
+	if(watch_mode != WATCH_MPI)
+		KVS_Progress_replicas();
+	
+	if(watch_mode == WATCH_FUTEX){
+		if(setnumber < 0 || setnumber >= num_requests || watch_versions[setnumber] < 0 || 
+				KVS_Get_watch_version(setnumber) == watch_versions[setnumber])
+			return 0;
+		watch_versions[setnumber] = -1;
+		return 1;
+	}
+	
+	if(watch_mode == WATCH_MAILBOX){
+		drain_mailbox();
+		if(setnumber < 0 || setnumber >= num_requests || watch_versions[setnumber] < 0 || 
+				watch_events[setnumber].setnumber < 0)
+			return 0;
+		watch_versions[setnumber] = -1;
+		return 1;
+	}
+	
+	//Also the progress path for the notifications this process sent
+	KVS_Progress_notifications();
+	
+	int flag = 0;
+	MPI_Status status;
+	if(setnumber >= 0 && setnumber < num_requests && requests[setnumber] != MPI_REQUEST_NULL)
+		MPI_Test(requests + setnumber, &flag, &status);
+	
+	// Request complete, pass it on if we are asked to
+	if(flag){
+		requests[setnumber] = MPI_REQUEST_NULL;
+		KVS_Notification_received(setnumber, watch_buffers[setnumber], &status);
+	}
+	
+	/*int flag = mpi_keyupdate_flag[setnumber];
+	mpi_keyupdate_flag[setnumber] = 0;*/	
+	return flag;
 }
 
 //check if the issued watch operation on the process set has returned or not
 int MPI_Session_check_psetupdate(MPI_Info ps_info){
+	int setnumber = info_setnumber(ps_info);
+	int flag = check_watch(setnumber);
+	if(flag)
+		prebuild_start(setnumber);
+	return flag;
+}
 
-	char setnumber_str[10];
-	int info_flag, setnumber;
+//check if the issued watch operation on the process set in the handle has returned or not
+int MPI_Session_check_psetupdate_handle(MPI_Pset_handle *handle){
+	int flag = check_watch(handle->setnumber);
+	if(flag)
+		prebuild_start(handle->setnumber);
+	return flag;
+}
 
-	MPI_Info_get(ps_info, "setnumber", 10, setnumber_str, &info_flag);
-	setnumber = strtol(setnumber_str, NULL, 10);
+//Watches of n distinct process sets by their setnumbers, -1 for sets that are not watched
+int testsome_sets(int n, const int *setnumbers, int *outcount, int *indices){
+	*outcount = 0;
+	if(watch_mode != WATCH_MPI){
+		for(int i = 0; i < n; i++){
+			if(check_watch(setnumbers[i])){
+				indices[(*outcount)++] = i;
+				prebuild_start(setnumbers[i]);
+			}
+		}
+		return MPI_SUCCESS;
+	}
+	
+	KVS_Progress_notifications();
+	
+	MPI_Request *reqs = malloc(sizeof(MPI_Request) * n + 1);
+	MPI_Status *statuses = malloc(sizeof(MPI_Status) * n + 1);
+	for(int i = 0; i < n; i++)
+		reqs[i] = setnumbers[i] >= 0 && setnumbers[i] < num_requests ? requests[setnumbers[i]] : MPI_REQUEST_NULL;
+	
+	MPI_Testsome(n, reqs, outcount, indices, statuses);
+	if(*outcount == MPI_UNDEFINED)
+		*outcount = 0;
+	
+	//Completed requests were set to MPI_REQUEST_NULL
+	for(int i = 0; i < *outcount; i++){
+		int setnumber = setnumbers[indices[i]];
+		requests[setnumber] = MPI_REQUEST_NULL;
+		KVS_Notification_received(setnumber, watch_buffers[setnumber], statuses + i);
+		prebuild_start(setnumber);
+	}
+	
+	free(reqs);
+	free(statuses);
+	return MPI_SUCCESS;
+}
 
+int waitany_sets(int n, const int *setnumbers, double timeout, int *index){
+	*index = MPI_UNDEFINED;
+	double end = MPI_Wtime() + timeout;
+	
+	if(watch_mode != WATCH_MPI){
+		bool watched = false;
+		for(int i = 0; i < n; i++)
+			if(setnumbers[i] >= 0 && setnumbers[i] < num_requests && watch_versions[setnumbers[i]] >= 0)
+				watched = true;
+		
+		//Changes on this node wake us, no matter which set they were in
+		int ret = watched ? MPI_ERR_PENDING : MPI_ERR_ARG;
+		while(watched){
+			int count = KVS_Get_change_count();
+			for(int i = 0; i < n && *index == MPI_UNDEFINED; i++)
+				if(check_watch(setnumbers[i]))
+					*index = i;
+			if(*index != MPI_UNDEFINED){
+				prebuild_start(setnumbers[*index]);
+				ret = MPI_SUCCESS;
+				break;
+			}
+			
+			double left = end - MPI_Wtime();
+			if(timeout >= 0 && left <= 0)
+				break;
+			KVS_Wait_replicas(count, timeout < 0 ? -1 : left);
+		}
+		return ret;
+	}
+	
+	MPI_Request *reqs = malloc(sizeof(MPI_Request) * n + 1);
+	for(int i = 0; i < n; i++)
+		reqs[i] = setnumbers[i] >= 0 && setnumbers[i] < num_requests ? requests[setnumbers[i]] : MPI_REQUEST_NULL;
+	
 	int flag = 0;
-	if(requests[setnumber] != MPI_REQUEST_NULL)
-		MPI_Test(requests + setnumber, &flag, MPI_STATUS_IGNORE);
-	if(flag){
-		MPI_Wait(requests + setnumber, MPI_STATUS_IGNORE);
+	MPI_Status status;
+	KVS_Progress_notifications();
+	if(timeout < 0){
+		MPI_Waitany(n, reqs, index, &status);
+		flag = 1;
+	}
+	else{
+		do{
+			KVS_Progress_notifications();
+			MPI_Testany(n, reqs, index, &flag, &status);
+		}while(!flag && (timeout < 0 || MPI_Wtime() < end));
 	}
 	
-	// Request complete
-	if(flag)
+	int ret = MPI_SUCCESS;
+	if(!flag)
+		ret = MPI_ERR_PENDING;
+	else if(*index == MPI_UNDEFINED)
+		ret = MPI_ERR_ARG;
+	else{
+		int setnumber = setnumbers[*index];
 		requests[setnumber] = MPI_REQUEST_NULL;
+		KVS_Notification_received(setnumber, watch_buffers[setnumber], &status);
+		prebuild_start(setnumber);
+	}
+	if(!flag)
+		*index = MPI_UNDEFINED;
 	
-	/*int flag = mpi_keyupdate_flag[setnumber];
-	mpi_keyupdate_flag[setnumber] = 0;*/	
-	return flag;
+	free(reqs);
+	return ret;
+}
+
+//The setnumbers of the sets in the infos, to be freed by the caller
+int *infos_setnumbers(int n, MPI_Info *ps_infos){
+	int *setnumbers = malloc(sizeof(int) * n + 1);
+	for(int i = 0; i < n; i++)
+		setnumbers[i] = info_setnumber(ps_infos[i]);
+	return setnumbers;
+}
+
+int *handles_setnumbers(int n, MPI_Pset_handle *handles){
+	int *setnumbers = malloc(sizeof(int) * n + 1);
+	for(int i = 0; i < n; i++)
+		setnumbers[i] = handles[i].setnumber;
+	return setnumbers;
 }
 
-//fetch information about the process set from KVS and return an MPI_Info object
+//check the watches on n distinct process sets at once. The positions of the sets whose 
+//watch returned are stored in indices, their number in outcount
+int MPI_Session_testsome_pset(int n, MPI_Info *ps_infos, int *outcount, int *indices){
+	int *setnumbers = infos_setnumbers(n, ps_infos);
+	int ret = testsome_sets(n, setnumbers, outcount, indices);
+	free(setnumbers);
+	return ret;
+}
+
+//MPI_Session_testsome_pset for the process sets in the handles, nothing is parsed
+int MPI_Session_testsome_pset_handle(int n, MPI_Pset_handle *handles, int *outcount, int *indices){
+	int *setnumbers = handles_setnumbers(n, handles);
+	int ret = testsome_sets(n, setnumbers, outcount, indices);
+	free(setnumbers);
+	return ret;
+}
+
+//wait until the watch on one of n distinct process sets returned, for at most timeout 
+//seconds if it is not negative. index is the position of that set, MPI_ERR_PENDING 
+//means the time ran out and MPI_ERR_ARG that none of the sets is watched
+int MPI_Session_waitany_pset_timeout(int n, MPI_Info *ps_infos, double timeout, int *index){
+	int *setnumbers = infos_setnumbers(n, ps_infos);
+	int ret = waitany_sets(n, setnumbers, timeout, index);
+	free(setnumbers);
+	return ret;
+}
+
+//wait until the watch on one of n distinct process sets returned
+int MPI_Session_waitany_pset(int n, MPI_Info *ps_infos, int *index){
+	return MPI_Session_waitany_pset_timeout(n, ps_infos, -1, index);
+}
+
+//MPI_Session_waitany_pset_timeout for the process sets in the handles
+int MPI_Session_waitany_pset_handle_timeout(int n, MPI_Pset_handle *handles, double timeout, int *index){
+	int *setnumbers = handles_setnumbers(n, handles);
+	int ret = waitany_sets(n, setnumbers, timeout, index);
+	free(setnumbers);
+	return ret;
+}
+
+int MPI_Session_waitany_pset_handle(int n, MPI_Pset_handle *handles, int *index){
+	return MPI_Session_waitany_pset_handle_timeout(n, handles, -1, index);
+}
+
+//call fn(set_name, old_version, new_version, arg) from the progress thread whenever 
+//the process set changed, starting from its current version. The watch is re-armed 
+//after every call, changes that happen in quick succession may be reported together
+int MPI_Session_register_pset_callback(char *set_name, MPI_Session_pset_callback fn, void *arg){
+	if(strlen(set_name) >= 50 || strcmp(set_name, "mpi://SELF") == 0)
+		return MPI_ERR_ARG;
+	
+	struct KVS_view view;
+	if(!KVS_Get_view(set_name, &view))
+		return MPI_ERR_ARG;
+	KVS_Release_view(&view); //Only the setnumber is needed, it does not change
+	
+	pthread_mutex_lock(&callbacks_mutex);
+	if(num_callbacks == mem_callbacks){
+		mem_callbacks = 2 * mem_callbacks + 1;
+		callbacks = realloc(callbacks, sizeof(struct pset_callback) * mem_callbacks);
+	}
+	struct pset_callback *cb = &callbacks[num_callbacks++];
+	strcpy(cb->name, set_name);
+	cb->setnumber = view.setnumber;
+	cb->version = KVS_Get_watch_version(view.setnumber);
+	cb->fn = fn;
+	cb->arg = arg;
+	pthread_mutex_unlock(&callbacks_mutex);
+	
+	return MPI_SUCCESS;
+}
+
+//remove all handlers of the process set
+int MPI_Session_unregister_pset_callback(char *set_name){
+	int n = 0;
+	pthread_mutex_lock(&callbacks_mutex);
+	for(int i = 0; i < num_callbacks; i++)
+		if(strcmp(callbacks[i].name, set_name) != 0)
+			callbacks[n++] = callbacks[i];
+	int found = n < num_callbacks;
+	num_callbacks = n;
+	pthread_mutex_unlock(&callbacks_mutex);
+	
+	return found ? MPI_SUCCESS : MPI_ERR_ARG;
+}
+
+//Sleeps until any set on this node changes and calls the handlers of the sets that did. 
+//With MPI_THREAD_MULTIPLE it also applies the updates of other nodes on node leaders, 
+//otherwise it makes no MPI calls and they are applied once the application enters the 
+//library. The handlers are called without holding the mutex, they may register further handlers
+void *progress_loop(void *unused){
+	struct pset_callback *fired = NULL;
+	int *new_versions = NULL, mem_fired = 0;
+	bool replicas = mpi_thread_level == MPI_THREAD_MULTIPLE;
+	
+	for(;;){
+		//Taken before the stop request is checked, so its wake up is not missed
+		int count = KVS_Get_change_count();
+		if(!__atomic_load_n(&progress_running, __ATOMIC_SEQ_CST))
+			break;
+		if(replicas)
+			KVS_Progress_replicas();
+		
+		pthread_mutex_lock(&callbacks_mutex);
+		if(mem_fired < num_callbacks){
+			mem_fired = mem_callbacks;
+			fired = realloc(fired, sizeof(struct pset_callback) * mem_fired);
+			new_versions = realloc(new_versions, sizeof(int) * mem_fired);
+		}
+		int num_fired = 0;
+		for(int i = 0; i < num_callbacks; i++){
+			int version = KVS_Get_watch_version(callbacks[i].setnumber);
+			if(version == callbacks[i].version)
+				continue;
+			fired[num_fired] = callbacks[i];
+			new_versions[num_fired++] = version;
+			callbacks[i].version = version;
+		}
+		pthread_mutex_unlock(&callbacks_mutex);
+		
+		for(int i = 0; i < num_fired; i++)
+			fired[i].fn(fired[i].name, fired[i].version, new_versions[i], fired[i].arg);
+		
+		if(replicas)
+			KVS_Wait_replicas(count, -1);
+		else
+			KVS_Wait_change(count, -1);
+	}
+	
+	free(fired);
+	free(new_versions);
+	return NULL;
+}
+
+//start the progress thread that calls the registered handlers, so the application 
+//does not have to poll for changes of the process sets
+int MPI_Session_start_progress_thread(){
+	if(progress_running)
+		return MPI_SUCCESS;
+	__atomic_store_n(&progress_running, true, __ATOMIC_RELEASE);
+	if(pthread_create(&progress_thread, NULL, progress_loop, NULL) != 0){
+		__atomic_store_n(&progress_running, false, __ATOMIC_RELEASE);
+		return MPI_ERR_OTHER;
+	}
+	return MPI_SUCCESS;
+}
+
+//stop the progress thread, returns once handlers it is running have finished
+int MPI_Session_stop_progress_thread(){
+	if(!progress_running)
+		return MPI_SUCCESS;
+	__atomic_store_n(&progress_running, false, __ATOMIC_SEQ_CST);
+	KVS_Wake_change();
+	pthread_join(progress_thread, NULL);
+	return MPI_SUCCESS;
+}
+
+//fetch the change that completed the last watch of the process set, only known in 
+//mailbox mode. op is one of KVS_DELTA_*, for KVS_DELTA_RESET the set has to be read 
+//again. MPI_ERR_PENDING means the watch did not complete yet
+int MPI_Session_get_psetupdate(MPI_Info ps_info, int *version, int *op, int *rank){
+	int setnumber = info_setnumber(ps_info);
+	
+	if(watch_mode != WATCH_MAILBOX || setnumber < 0 || setnumber >= num_requests)
+		return MPI_ERR_ARG;
+	if(watch_versions[setnumber] >= 0 || watch_events[setnumber].setnumber < 0)
+		return MPI_ERR_PENDING;
+	
+	*version = watch_events[setnumber].version;
+	*op = watch_events[setnumber].op;
+	*rank = watch_events[setnumber].rank;
+	return MPI_SUCCESS;
+}
+
+//fetch the current version of the process set from KVS into a handle, which the 
+//_pset_handle variants of the routines take instead of the MPI_Info. Returns 
+//MPI_ERR_ARG if there is no such set
+int MPI_Session_get_pset_handle(MPI_Session** mpisession, char *ps_name, MPI_Pset_handle *handle){
+	if(mpisession == NULL || strlen(ps_name) >= MPI_PSET_NAME_LEN){
+		return MPI_ERR_ARG;
+	}
+	strcpy(handle->name, ps_name);
+	
+	if(strcmp(ps_name, "mpi://SELF") == 0){
+		handle->setnumber = -1;
+		handle->version = 1;
+		handle->size = 1;
+		return MPI_SUCCESS;
+	}
+	
+	struct KVS_view view;
+	bool found;
+	do{
+		found = KVS_Get_view(ps_name, &view);
+	}while(!KVS_Release_view(&view));
+	if(!found)
+		return MPI_ERR_ARG;
+	
+	handle->setnumber = view.setnumber;
+	handle->version = view.version;
+	handle->size = view.num_ranks;
+	return MPI_SUCCESS;
+}
+
+//fetch information about the process set from KVS and return an MPI_Info object, 
+//MPI_INFO_NULL if there is no such set
 void MPI_Session_get_set_info(MPI_Session** mpisession, char *ps_name, 
 	MPI_Info *info){
 
@@ -471,14 +1701,16 @@ void MPI_Session_get_set_info(MPI_Session** mpisession, char *ps_name,
 		return;
 	}
 
-	int num_ranks, version, *ranks, setnumber;
-	KVS_Get(ps_name, &num_ranks, &ranks, &version, &setnumber);
+	MPI_Pset_handle handle;
+	if(MPI_Session_get_pset_handle(mpisession, ps_name, &handle) != MPI_SUCCESS){
+		*(info) = MPI_INFO_NULL;
+		return;
+	}
 	
-	//TODO IMPROVEMENt: Should probably change this to be dynamic?
-	char size_str[5], version_str[5], setnumber_str[5];
-	sprintf(size_str, "%d", num_ranks);
-	sprintf(version_str, "%d", version);
-	sprintf(setnumber_str,"%d", setnumber); 
+	char size_str[12], version_str[12], setnumber_str[12];
+	sprintf(size_str, "%d", handle.size);
+	sprintf(version_str, "%d", handle.version);
+	sprintf(setnumber_str,"%d", handle.setnumber); 
 
 	MPI_Info info_temp;
 	MPI_Info_create(&info_temp);
@@ -488,8 +1720,6 @@ void MPI_Session_get_set_info(MPI_Session** mpisession, char *ps_name,
 	MPI_Info_set(info_temp, "setname", ps_name);
 
 	*(info) = info_temp;
-
-	free(ranks);
 }
 
 //create the unqiue name for the process
@@ -547,7 +1777,8 @@ void MPI_Session_gather_processnames(int rank, int size){
 
 }
 
-//free the memory utilized by the library
+//free the memory utilized by the library, collective over MPI_COMM_WORLD: all processes 
+//have to call it, with MPI_SESSIONS_BACKEND=rma the KVS window is freed together
 void MPI_Session_free(){
 	MPI_Barrier(MPI_COMM_WORLD);
 	
@@ -564,8 +1795,7 @@ void MPI_Session_free(){
 	}
 	
 	if(mpi_setnames != NULL){ 
-		// Not counting mpi://SELF + mpi://WORLD, do I have inconsistent use of this var?
-		for (int i=0; i<mpi_nsets-2; i++) {
+		for (int i=0; i<mpi_num_setnames; i++) {
 			free(mpi_setnames[i]);
 		}
 		free(mpi_setnames);
@@ -593,9 +1823,65 @@ void MPI_Session_free(){
 	}
 	*/
 	
-	free(requests);
+	//Creations still running are speculative, the other members may never join them. 
+	//They are left to their threads along with their entries and groups
+	for(int i = 0; i < num_prebuilt; i++){
+		if(prebuilt[i] != NULL && prebuilt[i]->version >= 0){
+			prebuild_abandon(prebuilt[i]);
+		}
+		else
+			free(prebuilt[i]);
+	}
+	free(prebuilt);
+	prebuilt = NULL;
+	num_prebuilt = 0;
+	prebuild_collect();
+	for(int i = 0; i < num_abandoned; i++){
+		MPI_Request_free(&(abandoned[i]->request));
+		struct group_cache_entry *cached = cache_find_group(abandoned[i]->group);
+		if(cached != NULL)
+			cached->group = MPI_GROUP_NULL;
+	}
+	free(abandoned);
+	abandoned = NULL;
+	num_abandoned = mem_abandoned = 0;
+	
+	//Cached groups and communicators, whether released or not
+	for(int i = 0; i < num_group_cache; i++){
+		if(group_cache[i].comm != MPI_COMM_NULL)
+			MPI_Comm_free(&(group_cache[i].comm));
+		if(group_cache[i].group != MPI_GROUP_NULL)
+			MPI_Group_free(&(group_cache[i].group));
+	}
+	free(group_cache);
+	group_cache = NULL;
+	num_group_cache = mem_group_cache = 0;
 	
+	MPI_Session_stop_progress_thread();
+	free(callbacks);
+	callbacks = NULL;
+	num_callbacks = mem_callbacks = 0;
+	
+	//Changes still on their way to other nodes. Freeing the KVS window is collective 
+	//over the node, like this whole call is over MPI_COMM_WORLD
+	KVS_Sync();
 	KVS_free();
+	if(mpi_node_comm != MPI_COMM_NULL){
+		MPI_Comm_free(&mpi_node_comm);
+	}
+	
+	//Watches nobody answered anymore
+	for(int i = 0; i < num_requests; i++){
+		if(requests[i] != MPI_REQUEST_NULL){
+			MPI_Cancel(requests + i);
+			MPI_Request_free(requests + i);
+		}
+		free(watch_buffers[i]);
+	}
+	free(requests);
+	free(watch_buffers);
+	free(watch_versions);
+	free(watch_events);
 	
 	
 	MPI_Finalize();
@@ -604,21 +1890,13 @@ void MPI_Session_free(){
 //free the resource allocated within the session
 void MPI_Session_finalize(MPI_Session** session){
 
-	if(mpi_local_nsets > 0){
-		for (int i=0; i<mpi_local_nsets; i++) {
-			free(mpi_local_process_sets[i]);
-		}
-		free(mpi_local_process_sets);
-	}
+	free_names(mpi_local_process_sets, mpi_local_names_n);
+	mpi_local_process_sets = NULL;
+	mpi_local_names_n = 0;
 
-	if(mpi_global_nsets > 0){
-		if(mpi_global_process_sets != NULL){
-		for (int i=0; i<mpi_global_nsets; i++) {
-			free(mpi_global_process_sets[i]);
-		}
-		free(mpi_global_process_sets);
-		}
-	}
+	free_names(mpi_global_process_sets, mpi_global_names_n);
+	mpi_global_process_sets = NULL;
+	mpi_global_names_n = 0;
 
 	if(*session != NULL){
 		free(*session);